@@ -17,11 +17,52 @@
 
 #define SOCKET_PATH "/tmp/bgce.sock"
 #define BGCE_BYTES_PER_PIXEL 4
-#define MAX_INPUT_DEVICES 4
+#define MAX_INPUT_DEVICES 15 // listed in ServerInfo, as many as fit in a message
+
+/*
+ * Buffers are ARGB8888 with premultiplied alpha: each color channel is
+ * already multiplied by the alpha, so it is never larger than it.
+ */
+
+/* Buffer flags */
+#define BGCE_BUFFER_OPAQUE (1 << 0) /* alpha is ignored, no blending */
 
 /* ----------------------------
  * Protocol Message Types
  * ---------------------------- */
+
+/*
+ * On the socket every message is a BGCEHeader followed by exactly
+ * length bytes of payload, the struct of its type. Payloads may be
+ * shorter than the struct, like a ServerInfo with only the devices
+ * present; the receiver zero-fills the rest and skips bytes it does
+ * not know about.
+ *
+ * Clients number their requests with a serial, which the server puts
+ * in the reply, so replies are told apart from the events arriving
+ * in between, which have serial 0.
+ */
+#define BGCE_PROTOCOL_VERSION 4
+#define BGCE_MAX_MSG_SIZE 4096 // header included
+#define BGCE_MAX_FDS 4         // passed along with one message
+
+struct BGCEHeader {
+	uint16_t version; // BGCE_PROTOCOL_VERSION
+	uint16_t type;
+	uint32_t length; // payload bytes following the header
+	uint32_t serial; // of the request, repeated in its reply, 0 for events
+	uint16_t fds;    // file descriptors passed along, up to BGCE_MAX_FDS
+	uint16_t pad;
+};
+
+/*
+ * A transaction is one message whose payload is other messages, each
+ * with its own header: draws, moves, submits and frame requests. The
+ * server applies them all before compositing again, so the screen
+ * never shows them half done.
+ */
+#define BGCE_MAX_TRANSACTION (BGCE_MAX_MSG_SIZE - sizeof(struct BGCEHeader))
+
 enum {
 	MSG_GET_SERVER_INFO = 1,
 	MSG_GET_BUFFER,
@@ -30,7 +71,15 @@ enum {
 	MSG_BUFFER_CHANGE,
 	MSG_FOCUS_CHANGE,
 	MSG_SUBSCRIBE_INPUT,
-	MSG_MOVE
+	MSG_MOVE,
+	MSG_SETUP_RING,
+	MSG_SUBMIT,
+	MSG_BUFFER_RELEASE,
+	MSG_FRAME,
+	MSG_FRAME_DONE,
+	MSG_DRAW_RECTS,
+	MSG_TRANSACTION,
+	MSG_GET_LATENCY
 };
 
 /* ----------------------------
@@ -38,11 +87,15 @@ enum {
  * ---------------------------- */
 
 struct InputDevice {
-	uint16_t id;        // internal index of server
+	uint16_t id;        // stays the same while plugged, InputEvent.device
 	uint16_t type_mask; // bitmask: KEY, REL, ABS, etc
 	char name[256];
 };
 
+/*
+ * Only the first MAX_INPUT_DEVICES plugged in are listed, the server logs
+ * when there are more. Events of the others still arrive with their id.
+ */
 struct ServerInfo {
 	uint32_t width;
 	uint32_t height;
@@ -51,9 +104,14 @@ struct ServerInfo {
 	struct InputDevice devices[MAX_INPUT_DEVICES];
 };
 
+/* Largest width or height of a client buffer */
+#define BGCE_MAX_BUFFER_SIZE 16384
+
 struct BufferRequest {
 	uint32_t width;
 	uint32_t height;
+	uint32_t flags;   // BGCE_BUFFER_*
+	uint32_t buffers; // 2 or 3 for a swapchain, 0 or 1 for a plain buffer
 };
 
 struct MoveRequest {
@@ -66,23 +124,152 @@ struct ResizeRequest {
 	uint32_t height;
 };
 
+/*
+ * The buffer itself is a memfd passed along with the reply, sealed so
+ * it cannot shrink. bgce_recv_msg() stores it in fd, it is not sent.
+ */
 struct BufferReply {
 	int status; // 0 for success, -1 for failure
-	char shm_name[64];
+	int32_t fd; // -1 when no buffer came with the message
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride; // bytes between rows, a multiple of 64
+	uint32_t buffers; // images in the swapchain, 1 for a plain buffer
+};
+
+/*
+ * Swapchain: the memfd starts with a BGCESwapchainState followed by
+ * the images, each stride * height bytes. The client acquires a free
+ * image, draws and submits it; the server shows it and frees the one
+ * it showed before, which it no longer reads. When the client finds
+ * no free image it sets waiting, and the server sends a
+ * MSG_BUFFER_RELEASE with the index it freed.
+ */
+#define BGCE_MAX_BUFFERS 3
+
+enum {
+	BGCE_OWNER_FREE = 0,
+	BGCE_OWNER_CLIENT, // acquired, being drawn
+	BGCE_OWNER_SERVER  // submitted or on screen
+};
+
+struct BGCESwapchainState {
+	uint32_t owner[BGCE_MAX_BUFFERS]; // BGCE_OWNER_*
+	uint32_t waiting;                 // the client wants a release message
+	uint8_t pad[48];                  // images start on a cache line
+};
+
+struct BufferIndex {
+	uint32_t index;
+};
+
+/* A changed area of a client buffer, in buffer coordinates */
+struct BGCERect {
+	int32_t x;
+	int32_t y;
 	uint32_t width;
 	uint32_t height;
 };
 
+/* Like ServerInfo devices, only the rects present are sent */
+#define BGCE_MAX_DRAW_RECTS 128 // per message, more take several
+
+struct DrawRects {
+	uint32_t count;
+	struct BGCERect rects[BGCE_MAX_DRAW_RECTS];
+};
+
+/*
+ * Sent once the first frame showing the client's next commit, a draw
+ * or a submit after its MSG_FRAME, is on screen. Requests made while
+ * one is still waiting are answered by that same one. A hidden
+ * client's commit paints nothing, it is called back with the next
+ * frame anything else on screen changes in.
+ */
+struct FrameDone {
+	uint64_t frame;      // counts up with every frame shown
+	uint64_t time_ns;    // CLOCK_MONOTONIC when it was shown
+	uint32_t refresh_ns; // between frames
+};
+
 struct InputEvent {
-       uint32_t code; /* key code or button code */
-       int32_t value; /* press=1, release=0, or delta */
-       int32_t x;     /* optional: for mouse move */
-       int32_t y;     /* optional: for mouse move */
-       struct InputDevice device;
+       uint32_t code;   /* key code or button code */
+       int32_t value;   /* press=1, release=0, or delta */
+       int32_t x;       /* optional: for mouse move */
+       int32_t y;       /* optional: for mouse move */
+       uint16_t device; /* id of the InputDevice in ServerInfo */
+       uint16_t type;   /* EV_KEY, EV_REL, ... */
+       uint64_t time_ns; /* CLOCK_MONOTONIC when the device reported it */
+};
+
+/*
+ * Input to photon latency the server measured since it started, per
+ * stage, all counted from the input device's timestamp: until the
+ * server handled it, moved the cursor, sent it to the client, got the
+ * client's next draw or submit, composited that and showed it.
+ */
+enum {
+	BGCE_LATENCY_DISPATCH,
+	BGCE_LATENCY_CURSOR,
+	BGCE_LATENCY_DELIVER,
+	BGCE_LATENCY_COMMIT,
+	BGCE_LATENCY_COMPOSE,
+	BGCE_LATENCY_PRESENT,
+	BGCE_LATENCY_STAGES
+};
+
+struct LatencyStage {
+	uint64_t count;
+	uint32_t p50_us; // within 1/8 of the exact value
+	uint32_t p99_us;
+	uint32_t max_us;
+	uint32_t pad;
+};
+
+struct LatencyReport {
+	uint32_t stages; // BGCE_LATENCY_STAGES
+	uint32_t pad;
+	struct LatencyStage stage[BGCE_LATENCY_STAGES];
+};
+
+/*
+ * Command ring: an optional path for draws and moves that avoids a
+ * socket write per call. The client produces commands into a ring in
+ * memory shared with the server, which consumes them whenever it is
+ * awake. Only when the server says it is sleeping does the client
+ * ring the doorbell, an eventfd; both come with the MSG_SETUP_RING
+ * reply.
+ *
+ * Requests keep their order across the two paths: each command says
+ * how many messages the client had sent on the socket since the ring
+ * was set up. The server applies commands before reading a socket
+ * message, but a command only once it has handled as many socket
+ * messages, so both are applied in the order they were issued.
+ */
+#define BGCE_RING_ENTRIES 256 // a power of two
+
+struct BGCECommand {
+	uint32_t type; // MSG_DRAW, MSG_DRAW_RECTS, MSG_MOVE, MSG_SUBMIT or MSG_FRAME
+	uint32_t sent; // socket messages sent before it
+	union {
+		struct MoveRequest move_request;
+		struct BufferIndex buffer_index;
+		struct BGCERect rect; // one per command, consecutive ones are merged
+	} data;
+};
+
+struct BGCERing {
+	uint32_t head;     // next entry the client fills, written by the client
+	uint32_t sleeping; // the server waits for the doorbell
+	uint8_t pad0[56];
+	uint32_t tail; // next entry the server reads, written by the server
+	uint8_t pad1[60];
+	struct BGCECommand cmds[BGCE_RING_ENTRIES];
 };
 
 struct BGCEMessage {
 	uint32_t type;
+	uint32_t serial; // see struct BGCEHeader
 	union {
 		struct ServerInfo server_info;
 		struct BufferRequest buffer_request;
@@ -90,6 +277,10 @@ struct BGCEMessage {
 		struct MoveRequest move_buffer_request;
 		struct InputEvent input_event;
 		struct MoveRequest move_request;
+		struct BufferIndex buffer_index;
+		struct FrameDone frame_done;
+		struct DrawRects draw_rects;
+		struct LatencyReport latency_report;
 	} data;
 };
 
@@ -97,10 +288,48 @@ struct BGCEMessage {
  * API Functions
  * ---------------------------- */
 
+/**
+ * Send one message made of a header and length bytes of payload,
+ * retrying partial writes. Returns the bytes written or -1 on error.
+ */
+ssize_t bgce_send(int conn, uint32_t type, const void* payload, size_t length);
+
+/* Same as bgce_send(), passing up to BGCE_MAX_FDS file descriptors */
+ssize_t bgce_send_fds(int conn, uint32_t type, const void* payload, size_t length, const int* fds, int nfds);
+
+/**
+ * Send msg and its serial with the payload its type carries from the server: requests
+ * of MSG_GET_SERVER_INFO and MSG_GET_BUFFER carry a different one, the
+ * library sends those with bgce_send().
+ */
 ssize_t bgce_send_msg(int conn, struct BGCEMessage* msg);
 
+/* Bytes of payload msg carries from the server, as bgce_send_msg() sends */
+size_t bgce_payload_size(const struct BGCEMessage* msg);
+
+/**
+ * Read exactly one message, however the bytes arrive.
+ * Returns the bytes read, 0 when the peer closed the connection or
+ * -1 on error, with errno EPROTO for a different protocol version.
+ * Buffer replies get the fd of their buffer, other fds are closed.
+ */
 ssize_t bgce_recv_msg(int conn, struct BGCEMessage* msg);
 
+/**
+ * Same as bgce_recv_msg(), also storing the file descriptors that came
+ * with the message in fds, room for BGCE_MAX_FDS, and their count in
+ * nfds.
+ */
+ssize_t bgce_recv_msg_fds(int conn, struct BGCEMessage* msg, int* fds, int* nfds);
+
+/**
+ * Decode one message from the len bytes at buf, for callers doing
+ * their own non-blocking reads into a BGCE_MAX_MSG_SIZE buffer.
+ * Returns the bytes it used, 0 when buf does not hold a whole message
+ * yet, or -1 on a protocol error.
+ */
+ssize_t bgce_parse_msg(const void* buf, size_t len, struct BGCEMessage* msg);
+
 /**
  * Connect to a BGCE server socket.
  * Returns a file descriptor, or -1 on error.
@@ -113,13 +342,109 @@ int bgce_connect(void);
  */
 int bgce_get_server_info(int fd, struct ServerInfo* out_info);
 
+/**
+ * Ask for the latency histograms of the server, see struct
+ * LatencyReport. Returns 0 on success, -1 on failure.
+ */
+int bgce_get_latency(int conn, struct LatencyReport* report);
+
 /**
  * Request a shared memory buffer from the server.
- * Fills in the reply structure with shm name and dimensions.
- * Returns 0 on success, -1 on failure.
+ * Returns the mapped buffer, or NULL on failure. Rows are padded to
+ * the stride of the reply, use bgce_get_buffer_reply() to learn it.
  */
 void* bgce_get_buffer(int conn, const struct BufferRequest req);
 
+/**
+ * Same as bgce_get_buffer(), also filling in the reply with the
+ * dimensions and stride of the buffer.
+ */
+void* bgce_get_buffer_reply(int conn, const struct BufferRequest req, struct BufferReply* reply);
+
+/**
+ * Map the buffer a reply describes, like the new one sent with
+ * MSG_BUFFER_CHANGE. Its size is reply->stride * reply->height.
+ * The fd of the reply is closed and set to -1 either way.
+ * Returns NULL on failure.
+ */
+void* bgce_map_buffer(struct BufferReply* reply);
+
+/* A swapchain as mapped by the client */
+struct BGCESwapchain {
+	int conn;
+	void* map;
+	size_t size;
+	struct BGCESwapchainState* state;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t count;
+	void* buffers[BGCE_MAX_BUFFERS];
+};
+
+/**
+ * Request a swapchain of req.buffers images, 2 or 3, and map it into
+ * sc. Returns 0 on success, -1 on failure.
+ */
+int bgce_get_swapchain(int conn, struct BufferRequest req, struct BGCESwapchain* sc);
+
+/**
+ * Replace the images of sc with those of reply, like the new ones sent
+ * with MSG_BUFFER_CHANGE. Images acquired before are gone. Returns 0
+ * on success, -1 on failure.
+ */
+int bgce_map_swapchain(struct BGCESwapchain* sc, struct BufferReply* reply);
+
+/**
+ * Take a free image to draw into, never blocks. Returns its index, or
+ * -1 when the server holds them all: try again once a
+ * MSG_BUFFER_RELEASE arrives.
+ */
+int bgce_acquire_buffer(struct BGCESwapchain* sc);
+
+/* Hand an acquired image to the server to show. Returns 0 or -1 */
+int bgce_submit_buffer(struct BGCESwapchain* sc, int index);
+
+void bgce_release_swapchain(struct BGCESwapchain* sc);
+
+/**
+ * Ask to be told when the next draw or submit reaches the screen,
+ * call it before committing. done, if not NULL, is called with data
+ * from whichever library call reads the MSG_FRAME_DONE, once.
+ * Returns 0 on success, -1 on failure.
+ */
+int bgce_request_frame(int conn, void (*done)(const struct FrameDone* done, void* data), void* data);
+
+/**
+ * Block until the MSG_FRAME_DONE arrives, storing it in done if not
+ * NULL. Messages read meanwhile are returned by bgce_recv_msg() later.
+ * Returns 0 on success, -1 on failure.
+ */
+int bgce_wait_frame(int conn, struct FrameDone* done);
+
+/**
+ * Open a transaction: from now on draws, moves, submits and frame
+ * requests on conn are kept, up to BGCE_MAX_TRANSACTION bytes, and
+ * bgce_commit() sends them in one go. Buffers cannot be requested
+ * meanwhile, that needs a reply. Returns 0 on success, -1 on failure.
+ */
+int bgce_begin(int conn);
+
+/*
+ * Send the open transaction, the server applies it all in one frame.
+ * It goes over the socket even with a command ring, requests made
+ * after it on the ring are held back until it is applied.
+ */
+int bgce_commit(int conn);
+
+/**
+ * Set up the command ring for this connection, best right after
+ * connecting. From then on bgce_draw() and bgce_move() go through it
+ * and rarely make a system call. Returns 0 on success, -1 when the
+ * server cannot, the socket is still used then.
+ */
+int bgce_enable_ring(int conn);
+
 int bgce_move(int fd, int x, int y);
 
 /**
@@ -129,6 +454,53 @@ int bgce_move(int fd, int x, int y);
  */
 int bgce_draw(int fd);
 
+/**
+ * Same as bgce_draw(), only repainting the n rects of the buffer that
+ * changed, so small updates cost little. Returns 0 on success, -1 on
+ * failure.
+ */
+int bgce_draw_rects(int fd, const struct BGCERect* rects, size_t n);
+
+/* ----------------------------
+ * Asynchronous use
+ * ---------------------------- */
+
+/*
+ * Clients with their own event loop poll the fd of bgce_get_fd() for
+ * reading and call bgce_dispatch() when it is ready, which never
+ * blocks: replies go to the callback of their request and everything
+ * else to the event handler. The calls above that wait for a reply
+ * keep what they read meanwhile for bgce_dispatch(), so call it after
+ * them too, not only when the fd is ready.
+ */
+
+/* The fd to poll for reading, conn itself */
+int bgce_get_fd(int conn);
+
+/**
+ * Send a request the server replies to, MSG_GET_SERVER_INFO,
+ * MSG_GET_BUFFER or MSG_GET_LATENCY, with length bytes of payload.
+ * done, if not NULL, is called with the reply and data from
+ * bgce_dispatch(), it owns the fd of buffer replies. Returns the
+ * serial of the request or 0 on failure. The ring is only set up with
+ * bgce_enable_ring(), MSG_SETUP_RING is refused here.
+ */
+uint32_t bgce_request(int conn, uint32_t type, const void* payload, size_t length,
+                      void (*done)(struct BGCEMessage* reply, void* data), void* data);
+
+/**
+ * Have bgce_dispatch() call handler with data for every message that
+ * is not a reply: input, buffer changes and releases, frame done. It
+ * owns the fd of buffer changes. NULL to ignore them, the default.
+ */
+void bgce_set_event_handler(int conn, void (*handler)(struct BGCEMessage* msg, void* data), void* data);
+
+/**
+ * Handle every message there is without blocking. Returns how many,
+ * or -1 when the connection is closed or broken.
+ */
+int bgce_dispatch(int conn);
+
 /**
  * Gracefully close connection and unmap any buffer.
  */
@@ -0,0 +1,409 @@
+#include "server.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLIT_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Pixel kernels used by every compositing path. Each instruction set
+ * provides row copies and fills, plus variants with non-temporal
+ * stores for destinations that are never read back, like the
+ * write-combined scanout buffers. init_blit() picks the best set the
+ * CPU supports, the rect helpers below dispatch through it.
+ *
+ * Blending is src-over with premultiplied alpha, dst = src + dst *
+ * (255 - src alpha) / 255. The blend kernels look at a few pixels at
+ * a time: opaque ones are copied, all-zero ones are skipped and only
+ * the rest pay for the multiplies.
+ */
+
+struct BlitOps {
+	const char* name;
+	void (*copy_row)(uint32_t* dst, const uint32_t* src, size_t n);
+	void (*copy_row_nt)(uint32_t* dst, const uint32_t* src, size_t n);
+	void (*fill_row)(uint32_t* dst, uint32_t color, size_t n);
+	void (*fill_row_nt)(uint32_t* dst, uint32_t color, size_t n);
+	void (*blend_row)(uint32_t* dst, const uint32_t* src, size_t n);
+	void (*fence)(void);
+};
+
+/* ---------------- Generic C ---------------- */
+
+static void copy_row_c(uint32_t* dst, const uint32_t* src, size_t n) {
+	memcpy(dst, src, n * BGCE_BYTES_PER_PIXEL);
+}
+
+static void fill_row_c(uint32_t* dst, uint32_t color, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		dst[i] = color;
+}
+
+static inline uint32_t blend_px(uint32_t d, uint32_t s) {
+	uint32_t ia = 255 - (s >> 24);
+
+	/* Two channels per multiply, x / 255 as (x + 128) * 257 >> 16 */
+	uint32_t rb = (d & 0x00FF00FF) * ia + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+	uint32_t ag = ((d >> 8) & 0x00FF00FF) * ia + 0x00800080;
+	ag = ((ag + ((ag >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+
+	/* Add the source saturating at 255 like adds_epu8, colors that are
+	 * not premultiplied can go over */
+	rb += s & 0x00FF00FF;
+	ag += (s >> 8) & 0x00FF00FF;
+	rb |= ((rb >> 8) & 0x00010001) * 0xFF;
+	ag |= ((ag >> 8) & 0x00010001) * 0xFF;
+	return (rb & 0x00FF00FF) | ((ag & 0x00FF00FF) << 8);
+}
+
+static void blend_row_c(uint32_t* dst, const uint32_t* src, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		uint32_t s = src[i];
+		if (s >= 0xFF000000)
+			dst[i] = s;
+		else if (s)
+			dst[i] = blend_px(dst[i], s);
+	}
+}
+
+static void fence_c(void) {
+}
+
+static const struct BlitOps generic_ops = {
+        .name = "generic",
+        .copy_row = copy_row_c,
+        .copy_row_nt = copy_row_c,
+        .fill_row = fill_row_c,
+        .fill_row_nt = fill_row_c,
+        .blend_row = blend_row_c,
+        .fence = fence_c,
+};
+
+#ifdef BLIT_X86
+
+/* ---------------- SSE2 ---------------- */
+
+__attribute__((target("sse2"))) static void copy_row_sse2(uint32_t* dst, const uint32_t* src, size_t n) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + i + 8));
+		__m128i d = _mm_loadu_si128((const __m128i*)(src + i + 12));
+		_mm_storeu_si128((__m128i*)(dst + i), a);
+		_mm_storeu_si128((__m128i*)(dst + i + 4), b);
+		_mm_storeu_si128((__m128i*)(dst + i + 8), c);
+		_mm_storeu_si128((__m128i*)(dst + i + 12), d);
+	}
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+	for (; i < n; i++)
+		dst[i] = src[i];
+}
+
+__attribute__((target("sse2"))) static void copy_row_nt_sse2(uint32_t* dst, const uint32_t* src, size_t n) {
+	/* Streaming stores need an aligned destination */
+	while (((uintptr_t)dst & 15) && n) {
+		*dst++ = *src++;
+		n--;
+	}
+
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + i + 8));
+		__m128i d = _mm_loadu_si128((const __m128i*)(src + i + 12));
+		_mm_stream_si128((__m128i*)(dst + i), a);
+		_mm_stream_si128((__m128i*)(dst + i + 4), b);
+		_mm_stream_si128((__m128i*)(dst + i + 8), c);
+		_mm_stream_si128((__m128i*)(dst + i + 12), d);
+	}
+	for (; i + 4 <= n; i += 4)
+		_mm_stream_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+	for (; i < n; i++)
+		dst[i] = src[i];
+}
+
+__attribute__((target("sse2"))) static void fill_row_sse2(uint32_t* dst, uint32_t color, size_t n) {
+	__m128i v = _mm_set1_epi32((int)color);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		_mm_storeu_si128((__m128i*)(dst + i), v);
+		_mm_storeu_si128((__m128i*)(dst + i + 4), v);
+		_mm_storeu_si128((__m128i*)(dst + i + 8), v);
+		_mm_storeu_si128((__m128i*)(dst + i + 12), v);
+	}
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_si128((__m128i*)(dst + i), v);
+	for (; i < n; i++)
+		dst[i] = color;
+}
+
+__attribute__((target("sse2"))) static void fill_row_nt_sse2(uint32_t* dst, uint32_t color, size_t n) {
+	while (((uintptr_t)dst & 15) && n) {
+		*dst++ = color;
+		n--;
+	}
+
+	__m128i v = _mm_set1_epi32((int)color);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm_stream_si128((__m128i*)(dst + i), v);
+	for (; i < n; i++)
+		dst[i] = color;
+}
+
+/* x * ia / 255 for 16 bit lanes, rounded */
+__attribute__((target("sse2"))) static inline __m128i mul_div255_sse2(__m128i x, __m128i ia) {
+	x = _mm_add_epi16(_mm_mullo_epi16(x, ia), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("sse2"))) static inline __m128i blend_sse2(__m128i d, __m128i s) {
+	__m128i zero = _mm_setzero_si128();
+
+	/* 255 - alpha of each pixel, repeated in its four 16 bit lanes */
+	__m128i ia = _mm_sub_epi32(_mm_set1_epi32(255), _mm_srli_epi32(s, 24));
+	ia = _mm_or_si128(ia, _mm_slli_epi32(ia, 16));
+
+	__m128i lo = mul_div255_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi32(ia, ia));
+	__m128i hi = mul_div255_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi32(ia, ia));
+	return _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+}
+
+__attribute__((target("sse2"))) static void blend_row_sse2(uint32_t* dst, const uint32_t* src, size_t n) {
+	__m128i amask = _mm_set1_epi32((int)0xFF000000);
+	__m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i a = _mm_and_si128(s, amask);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, amask)) == 0xFFFF) {
+			_mm_storeu_si128((__m128i*)(dst + i), s);
+			continue;
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xFFFF)
+			continue;
+
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		_mm_storeu_si128((__m128i*)(dst + i), blend_sse2(d, s));
+	}
+	blend_row_c(dst + i, src + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void fence_sse2(void) {
+	_mm_sfence();
+}
+
+static const struct BlitOps sse2_ops = {
+        .name = "sse2",
+        .copy_row = copy_row_sse2,
+        .copy_row_nt = copy_row_nt_sse2,
+        .fill_row = fill_row_sse2,
+        .fill_row_nt = fill_row_nt_sse2,
+        .blend_row = blend_row_sse2,
+        .fence = fence_sse2,
+};
+
+/* ---------------- AVX2 ---------------- */
+
+__attribute__((target("avx2"))) static void copy_row_avx2(uint32_t* dst, const uint32_t* src, size_t n) {
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 8));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(src + i + 16));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(src + i + 24));
+		_mm256_storeu_si256((__m256i*)(dst + i), a);
+		_mm256_storeu_si256((__m256i*)(dst + i + 8), b);
+		_mm256_storeu_si256((__m256i*)(dst + i + 16), c);
+		_mm256_storeu_si256((__m256i*)(dst + i + 24), d);
+	}
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+	for (; i < n; i++)
+		dst[i] = src[i];
+}
+
+__attribute__((target("avx2"))) static void copy_row_nt_avx2(uint32_t* dst, const uint32_t* src, size_t n) {
+	while (((uintptr_t)dst & 31) && n) {
+		*dst++ = *src++;
+		n--;
+	}
+
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 8));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(src + i + 16));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(src + i + 24));
+		_mm256_stream_si256((__m256i*)(dst + i), a);
+		_mm256_stream_si256((__m256i*)(dst + i + 8), b);
+		_mm256_stream_si256((__m256i*)(dst + i + 16), c);
+		_mm256_stream_si256((__m256i*)(dst + i + 24), d);
+	}
+	for (; i + 8 <= n; i += 8)
+		_mm256_stream_si256((__m256i*)(dst + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+	for (; i < n; i++)
+		dst[i] = src[i];
+}
+
+__attribute__((target("avx2"))) static void fill_row_avx2(uint32_t* dst, uint32_t color, size_t n) {
+	__m256i v = _mm256_set1_epi32((int)color);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		_mm256_storeu_si256((__m256i*)(dst + i), v);
+		_mm256_storeu_si256((__m256i*)(dst + i + 8), v);
+		_mm256_storeu_si256((__m256i*)(dst + i + 16), v);
+		_mm256_storeu_si256((__m256i*)(dst + i + 24), v);
+	}
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_si256((__m256i*)(dst + i), v);
+	for (; i < n; i++)
+		dst[i] = color;
+}
+
+__attribute__((target("avx2"))) static void fill_row_nt_avx2(uint32_t* dst, uint32_t color, size_t n) {
+	while (((uintptr_t)dst & 31) && n) {
+		*dst++ = color;
+		n--;
+	}
+
+	__m256i v = _mm256_set1_epi32((int)color);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_stream_si256((__m256i*)(dst + i), v);
+	for (; i < n; i++)
+		dst[i] = color;
+}
+
+__attribute__((target("avx2"))) static inline __m256i mul_div255_avx2(__m256i x, __m256i ia) {
+	x = _mm256_add_epi16(_mm256_mullo_epi16(x, ia), _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+/* Same as blend_sse2, the unpacks and packs work within 128 bit lanes */
+__attribute__((target("avx2"))) static inline __m256i blend_avx2(__m256i d, __m256i s) {
+	__m256i zero = _mm256_setzero_si256();
+
+	__m256i ia = _mm256_sub_epi32(_mm256_set1_epi32(255), _mm256_srli_epi32(s, 24));
+	ia = _mm256_or_si256(ia, _mm256_slli_epi32(ia, 16));
+
+	__m256i lo = mul_div255_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi32(ia, ia));
+	__m256i hi = mul_div255_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi32(ia, ia));
+	return _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi));
+}
+
+__attribute__((target("avx2"))) static void blend_row_avx2(uint32_t* dst, const uint32_t* src, size_t n) {
+	__m256i amask = _mm256_set1_epi32((int)0xFF000000);
+	__m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i a = _mm256_and_si256(s, amask);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, amask)) == -1) {
+			_mm256_storeu_si256((__m256i*)(dst + i), s);
+			continue;
+		}
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(s, zero)) == -1)
+			continue;
+
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), blend_avx2(d, s));
+	}
+	blend_row_c(dst + i, src + i, n - i);
+}
+
+static const struct BlitOps avx2_ops = {
+        .name = "avx2",
+        .copy_row = copy_row_avx2,
+        .copy_row_nt = copy_row_nt_avx2,
+        .fill_row = fill_row_avx2,
+        .fill_row_nt = fill_row_nt_avx2,
+        .blend_row = blend_row_avx2,
+        .fence = fence_sse2,
+};
+
+#endif /* BLIT_X86 */
+
+static const struct BlitOps* ops = &generic_ops;
+
+void init_blit(void) {
+#ifdef BLIT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		ops = &avx2_ops;
+	} else if (__builtin_cpu_supports("sse2")) {
+		ops = &sse2_ops;
+	}
+#endif
+	printf("[BGCE] Using %s blit kernels\n", ops->name);
+}
+
+void blit_copy_row(uint32_t* dst, const uint32_t* src, size_t n) {
+	ops->copy_row(dst, src, n);
+}
+
+/* Rows that follow each other in both buffers are one long row */
+void blit_copy_rect(void* dst, size_t dst_stride, const void* src, size_t src_stride, uint32_t w, uint32_t h) {
+	size_t row = (size_t)w * BGCE_BYTES_PER_PIXEL;
+	if (dst_stride == row && src_stride == row) {
+		ops->copy_row(dst, src, (size_t)w * h);
+		return;
+	}
+	for (uint32_t y = 0; y < h; y++) {
+		ops->copy_row((uint32_t*)((uint8_t*)dst + y * dst_stride),
+		              (const uint32_t*)((const uint8_t*)src + y * src_stride), w);
+	}
+}
+
+void blit_copy_rect_nt(void* dst, size_t dst_stride, const void* src, size_t src_stride, uint32_t w, uint32_t h) {
+	size_t row = (size_t)w * BGCE_BYTES_PER_PIXEL;
+	if (dst_stride == row && src_stride == row) {
+		ops->copy_row_nt(dst, src, (size_t)w * h);
+	} else {
+		for (uint32_t y = 0; y < h; y++) {
+			ops->copy_row_nt((uint32_t*)((uint8_t*)dst + y * dst_stride),
+			                 (const uint32_t*)((const uint8_t*)src + y * src_stride), w);
+		}
+	}
+	ops->fence();
+}
+
+void blit_fill_rect(void* dst, size_t dst_stride, uint32_t color, uint32_t w, uint32_t h) {
+	if (dst_stride == (size_t)w * BGCE_BYTES_PER_PIXEL) {
+		ops->fill_row(dst, color, (size_t)w * h);
+		return;
+	}
+	for (uint32_t y = 0; y < h; y++) {
+		ops->fill_row((uint32_t*)((uint8_t*)dst + y * dst_stride), color, w);
+	}
+}
+
+void blit_fill_rect_nt(void* dst, size_t dst_stride, uint32_t color, uint32_t w, uint32_t h) {
+	if (dst_stride == (size_t)w * BGCE_BYTES_PER_PIXEL) {
+		ops->fill_row_nt(dst, color, (size_t)w * h);
+	} else {
+		for (uint32_t y = 0; y < h; y++) {
+			ops->fill_row_nt((uint32_t*)((uint8_t*)dst + y * dst_stride), color, w);
+		}
+	}
+	ops->fence();
+}
+
+void blit_blend_rect(void* dst, size_t dst_stride, const void* src, size_t src_stride, uint32_t w, uint32_t h) {
+	if (dst_stride == (size_t)w * BGCE_BYTES_PER_PIXEL && src_stride == dst_stride) {
+		ops->blend_row(dst, src, (size_t)w * h);
+		return;
+	}
+	for (uint32_t y = 0; y < h; y++) {
+		ops->blend_row((uint32_t*)((uint8_t*)dst + y * dst_stride),
+		               (const uint32_t*)((const uint8_t*)src + y * src_stride), w);
+	}
+}
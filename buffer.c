@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Client buffers are anonymous memfds: there are no names to collide
+ * or unlink, the fd goes to the client with the reply. They are sealed
+ * so a client cannot shrink them under the compositor, which would
+ * fault reading past the end.
+ *
+ * A swapchain is one memfd holding the ownership flags and its images,
+ * see struct BGCESwapchainState. The server owns the image on screen
+ * and frees it as soon as another one is submitted: the compositor
+ * only ever reads the current one, under the server lock.
+ */
+
+extern struct ServerState server;
+
+static void* create_buffer(size_t size, int* fd) {
+	int mem_fd = memfd_create("bgce-buffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (mem_fd < 0) {
+		perror("[BGCE] memfd_create");
+		return NULL;
+	}
+
+	if (ftruncate(mem_fd, size) < 0) {
+		perror("[BGCE] ftruncate buffer");
+		close(mem_fd);
+		return NULL;
+	}
+
+	if (fcntl(mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+		perror("[BGCE] seal buffer");
+		close(mem_fd);
+		return NULL;
+	}
+
+	void* buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+	if (buffer == MAP_FAILED) {
+		perror("[BGCE] mmap buffer");
+		close(mem_fd);
+		return NULL;
+	}
+
+	*fd = mem_fd;
+	return buffer;
+}
+
+int allocate_buffers(struct Client* c, uint32_t width, uint32_t height, uint32_t count, uint32_t flags) {
+	if (count < 1)
+		count = 1;
+	if (count > BGCE_MAX_BUFFERS)
+		count = BGCE_MAX_BUFFERS;
+
+	/* Resizes can go negative too, which wraps to a huge width */
+	if (width == 0 || height == 0 || width > BGCE_MAX_BUFFER_SIZE || height > BGCE_MAX_BUFFER_SIZE) {
+		fprintf(stderr, "[BGCE] Client fd=%d asked for a %ux%u buffer\n", c->fd, width, height);
+		return -1;
+	}
+
+	size_t stride = ALIGN_STRIDE(width);
+	size_t header = count > 1 ? sizeof(struct BGCESwapchainState) : 0;
+	if (stride > SIZE_MAX / height || stride * height > (SIZE_MAX - header) / count) {
+		fprintf(stderr, "[BGCE] Client fd=%d buffer size overflows\n", c->fd);
+		return -1;
+	}
+	size_t image = stride * height;
+	size_t size = header + image * count;
+
+	int fd;
+	uint8_t* map = create_buffer(size, &fd);
+	if (!map)
+		return -1;
+
+	/* The last image is on screen, the client starts with the first */
+	struct BGCESwapchainState* state = NULL;
+	if (count > 1) {
+		state = (struct BGCESwapchainState*)map;
+		state->owner[count - 1] = BGCE_OWNER_SERVER;
+	}
+
+	// Unmap the old buffers once the compositor let go of them
+	void* old_map = c->map;
+	size_t old_size = c->map_size;
+	swap_client_buffer(&server, c, map + header + image * (count - 1), width, height, stride, flags);
+	if (old_map)
+		munmap(old_map, old_size);
+
+	c->map = map;
+	c->map_size = size;
+	c->buffer_count = count;
+	c->current = count - 1;
+	c->swapchain = state;
+	return fd;
+}
+
+void submit_buffer(struct Client* c, uint32_t index) {
+	if (!c->swapchain || index >= c->buffer_count || index == c->current) {
+		fprintf(stderr, "[BGCE] Client fd=%d submitted bad buffer %u\n", c->fd, index);
+		return;
+	}
+
+	size_t image = (size_t)c->stride * c->height;
+	present_client_buffer(&server, c, (uint8_t*)c->map + sizeof(struct BGCESwapchainState) + image * index);
+
+	/* Nothing reads the old one anymore */
+	uint32_t old = c->current;
+	c->current = index;
+	__atomic_store_n(&c->swapchain->owner[old], BGCE_OWNER_FREE, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&c->swapchain->waiting, 0, __ATOMIC_SEQ_CST)) {
+		struct BGCEMessage msg = {.type = MSG_BUFFER_RELEASE};
+		msg.data.buffer_index.index = old;
+		client_send_msg(c, &msg);
+	}
+}
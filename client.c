@@ -1,32 +1,120 @@
 #include "bgce.h"
 
 #include <linux/input.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
 int w = 800;
 int h = 600;
+uint32_t stride = 0;
 uint8_t* buf = NULL;
+struct BGCESwapchain chain;
+int redraw = 0; // no free buffer, draw once one is released
+int quit = 0;
+int frames = 0; // shown frames left to animate, 0 draws once
+int tick = 0;
+struct ServerInfo info;
 
 void draw_gradient() {
 	for (int y = 0; y < h; y++) {
 		for (int x = 0; x < w; x++) {
-			uint32_t* p = (uint32_t*)buf + (y * w + x);
+			uint32_t* p = (uint32_t*)(buf + y * stride) + x;
 
 			uint8_t r = (x * 255) / w;
 			uint8_t g = (y * 255) / h;
-			uint8_t b = 128;
+			uint8_t b = 128 + tick;
 
 			*p = 0xFF000000 | (r << 16) | (g << 8) | b; // ARGB
 		}
 	}
 }
 
-int main(void) {
+/* Draw a frame into a free buffer and show it */
+int present(void) {
+	int i = bgce_acquire_buffer(&chain);
+	if (i < 0) {
+		redraw = 1;
+		return 0;
+	}
+	redraw = 0;
+	tick++;
+
+	buf = chain.buffers[i];
+	if (!frames)
+		printf("[BGCE] Drawing gradient into buffer %d...\n", i);
+	draw_gradient();
+	bgce_request_frame(chain.conn, NULL, NULL);
+	return bgce_submit_buffer(&chain, i);
+}
+
+/* Called from bgce_dispatch() for everything the server sends */
+void handle_event(struct BGCEMessage* msg, void* data) {
+	(void)data;
+
+	switch (msg->type) {
+	case MSG_INPUT_EVENT: {
+		struct InputEvent ev = msg->data.input_event;
+
+		/* Example: Print keyboard/mouse input */
+		const char* name = "?"; // plugged after we asked
+		for (int i = 0; i < info.input_device_count; i++) {
+			if (info.devices[i].id == ev.device)
+				name = info.devices[i].name;
+		}
+		printf("[BGCE Client] Input event: device=%s code=%u value=%d\n",
+		       name, ev.code, ev.value);
+		break;
+	}
+	case MSG_BUFFER_CHANGE: {
+		struct BufferReply* b = &msg->data.buffer_reply;
+		printf("[BGCE] Buffer change event: w=%u h=%u\n", b->width, b->height);
+
+		if (bgce_map_swapchain(&chain, b) < 0) {
+			fprintf(stderr, "[BGCE] Failed to map new buffer\n");
+			quit = 1;
+			break;
+		}
+		w = b->width;
+		h = b->height;
+		stride = b->stride;
+
+		if (present() < 0) {
+			fprintf(stderr, "[BGCE] Draw failed\n");
+			quit = 1;
+		}
+		break;
+	}
+	case MSG_FRAME_DONE: {
+		struct FrameDone done = msg->data.frame_done;
+		printf("[BGCE Client] Frame %llu shown at %llu ns\n",
+		       (unsigned long long)done.frame, (unsigned long long)done.time_ns);
+		if (frames && --frames == 0)
+			quit = 1;
+		break;
+	}
+	case MSG_BUFFER_RELEASE:
+		if (redraw && present() < 0) {
+			fprintf(stderr, "[BGCE] Draw failed\n");
+			quit = 1;
+		}
+		break;
+
+	default:
+		printf("[BGCE Client] Unknown message type %d\n", msg->type);
+		break;
+	}
+}
+
+/* Usage: client [frames], animating until that many frames were shown */
+int main(int argc, char** argv) {
 	setvbuf(stdout, NULL, _IONBF, 0); // Disable buffering for stdout
 	setvbuf(stderr, NULL, _IONBF, 0); // Disable buffering for stderr
+	if (argc > 1)
+		frames = atoi(argv[1]);
 
 	int conn = bgce_connect();
 	if (conn < 0) {
@@ -34,12 +122,15 @@ int main(void) {
 		return 1;
 	}
 
-	struct ServerInfo info;
 	if (bgce_get_server_info(conn, &info) < 0) {
 		fprintf(stderr, "[BGCE] Failed to get server info\n");
 		return 2;
 	}
 
+	if (bgce_enable_ring(conn) < 0) {
+		printf("[BGCE] No command ring, drawing through the socket\n");
+	}
+
 	printf("[BGCE] Server info: %dx%d, %d-bit color\n",
 	       info.width, info.height, info.color_depth);
 
@@ -51,71 +142,63 @@ int main(void) {
 		       info.devices[i].type_mask);
 	}
 
-	struct BufferRequest req = {.width = w, .height = h};
-	buf = bgce_get_buffer(conn, req);
-	if (!buf) {
+	struct BufferRequest req = {.width = w, .height = h, .flags = BGCE_BUFFER_OPAQUE, .buffers = 2};
+	if (bgce_get_swapchain(conn, req, &chain) < 0) {
 		fprintf(stderr, "[BGCE] Failed to get buffer\n");
 		return 3;
 	}
-	printf("Client got buffer at: %p\n", buf);
+	stride = chain.stride;
+	printf("Client got %u buffers at: %p\n", chain.count, chain.map);
 
-	printf("[BGCE] Drawing gradient...\n");
-	draw_gradient();
-
-	if (bgce_draw(conn) < 0) {
+	if (present() < 0) {
 		fprintf(stderr, "[BGCE] Draw failed\n");
 		return 4;
 	}
 
 	printf("[BGCE] Frame drawn. Check /tmp/bgce_frame.ppm\n");
 
+	bgce_set_event_handler(conn, handle_event, NULL);
+
 	time_t start_time = time(NULL);
-	while (1) {
-		struct BGCEMessage msg;
-		ssize_t rc = bgce_recv_msg(conn, &msg);
-		if (rc <= 0) {
+	struct pollfd pfd = {.fd = bgce_get_fd(conn), .events = POLLIN};
+	while (!quit) {
+		// Messages may have been read during the calls above already
+		if (bgce_dispatch(conn) < 0) {
 			printf("[BGCE Client] Disconnected from server\n");
 			break;
 		}
 
-		switch (msg.type) {
-		case MSG_INPUT_EVENT: {
-			struct InputEvent ev = msg.data.input_event;
-
-			/* Example: Print keyboard/mouse input */
-			printf("[BGCE Client] Input event: device=%s code=%hu value=%d\n",
-			       ev.device.name, ev.code, ev.value);
+		// Animations draw again as soon as a buffer is free
+		int busy = frames && !redraw && !quit;
+		if (busy && present() < 0) {
+			fprintf(stderr, "[BGCE] Draw failed\n");
 			break;
 		}
-		case MSG_BUFFER_CHANGE: {
-			struct BufferReply b = msg.data.buffer_reply;
-			printf("[BGCE] Buffer change event: w=%u h=%u shm_name=%s\n", b.width, b.height, b.shm_name);
-
-			w = b.width;
-			h = b.height;
 
-			printf("[BGCE] Drawing gradient...\n");
-			draw_gradient();
-
-			if (bgce_draw(conn) < 0) {
-				fprintf(stderr, "[BGCE] Draw failed\n");
-				return 4;
-			}
+		// Check if 10 seconds have passed
+		if (time(NULL) - start_time >= 10) {
+			printf("[BGCE Client] Timeout reached, exiting...\n");
 			break;
 		}
 
-		default:
-			printf("[BGCE Client] Unknown message type %d\n", msg.type);
+		if (poll(&pfd, 1, busy ? 0 : 1000) < 0) {
+			perror("poll");
 			break;
 		}
+	}
 
-		// Check if 10 seconds have passed
-		if (time(NULL) - start_time >= 10) {
-			printf("[BGCE Client] Timeout reached, exiting...\n");
-			break;
+	static const char* stages[BGCE_LATENCY_STAGES] = {
+	        "dispatch", "cursor", "deliver", "commit", "compose", "present"};
+	struct LatencyReport lat;
+	if (bgce_get_latency(conn, &lat) == 0) {
+		for (int s = 0; s < BGCE_LATENCY_STAGES; s++) {
+			printf("[BGCE Client] Latency %-8s n=%llu p50=%uus p99=%uus max=%uus\n",
+			       stages[s], (unsigned long long)lat.stage[s].count,
+			       lat.stage[s].p50_us, lat.stage[s].p99_us, lat.stage[s].max_us);
 		}
 	}
 
+	bgce_release_swapchain(&chain);
 	bgce_disconnect(conn);
 
 	return 0;
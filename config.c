@@ -39,8 +39,25 @@ static uint32_t parse_hex_color(const char* str) {
 	return (a << 24) | (r << 16) | (g << 8) | b;
 }
 
+// Helper: parse yes/no, true/false, on/off or 1/0
+static int parse_bool(const char* str) {
+	return strcmp(str, "yes") == 0 || strcmp(str, "true") == 0 ||
+	       strcmp(str, "on") == 0 || strcmp(str, "1") == 0;
+}
+
 // Parse config file
 int parse_config(struct config* config) {
+	// Initialize with defaults, also used when there is no config file
+	memset(config, 0, sizeof(*config));
+	config->type = BG_COLOR;
+	config->color = 0xAAAAAAAA; // Default gray
+	config->shadow = 1;
+	config->buffers = 2;
+	strcpy(config->backend, "drm");
+	config->width = 1280;
+	config->height = 720;
+	config->refresh = 60;
+
 	const char* home = getenv("HOME");
 	char user_config[512];
 	if (!home) {
@@ -53,10 +70,6 @@ int parse_config(struct config* config) {
 		return -1;
 	}
 
-	// Initialize with defaults
-	config->type = BG_COLOR;
-	config->color = 0xAAAAAAAA; // Default gray
-
 	char line[1024];
 	char current_section[256] = "";
 
@@ -104,6 +117,23 @@ int parse_config(struct config* config) {
 					config->mode = IMAGE_SCALED;
 				}
 			}
+		} else if (strcmp(current_section, "display") == 0) {
+			if (strcmp(key, "shadow") == 0) {
+				config->shadow = parse_bool(value);
+			} else if (strcmp(key, "buffers") == 0) {
+				config->buffers = atoi(value);
+			} else if (strcmp(key, "backend") == 0) {
+				strncpy(config->backend, value, sizeof(config->backend) - 1);
+				config->backend[sizeof(config->backend) - 1] = '\0';
+			} else if (strcmp(key, "width") == 0) {
+				config->width = atoi(value);
+			} else if (strcmp(key, "height") == 0) {
+				config->height = atoi(value);
+			} else if (strcmp(key, "refresh") == 0) {
+				config->refresh = atoi(value);
+			} else if (strcmp(key, "workers") == 0) {
+				config->workers = atoi(value);
+			}
 		}
 	}
 
@@ -115,9 +145,7 @@ int parse_config(struct config* config) {
 int apply_background(struct config* config, uint32_t* buffer, uint32_t width, uint32_t height) {
 	if (config->type == BG_COLOR) {
 		// Fill with solid color
-		for (uint32_t i = 0; i < width * height; i++) {
-			buffer[i] = config->color;
-		}
+		blit_fill_rect(buffer, width * BGCE_BYTES_PER_PIXEL, config->color, width, height);
 		return 0;
 	} else if (config->type == BG_IMAGE) {
 		// Load and apply image
@@ -127,27 +155,25 @@ int apply_background(struct config* config, uint32_t* buffer, uint32_t width, ui
 			fprintf(stderr, "Failed to load image: %s\n", config->path);
 			// Fallback to a default color (dark gray with full opacity)
 			fprintf(stderr, "[BGCE] Falling back to default color #333333\n");
-			for (uint32_t i = 0; i < width * height; i++) {
-				buffer[i] = 0xFF333333;
-			}
+			blit_fill_rect(buffer, width * BGCE_BYTES_PER_PIXEL, 0xFF333333, width, height);
 			return 0;
 		}
 
 		if (config->mode == IMAGE_TILED) {
-			// Tile the image
-			for (uint32_t y = 0; y < height; y++) {
-				for (uint32_t x = 0; x < width; x++) {
-					uint32_t img_x = x % img_width;
-					uint32_t img_y = y % img_height;
-					uint32_t img_idx = (img_y * img_width + img_x) * 4;
-					uint32_t buf_idx = y * width + x;
+			// Convert RGBA to uint32_t once, in place
+			uint32_t* img = (uint32_t*)img_data;
+			for (int i = 0; i < img_width * img_height; i++) {
+				uint8_t* p = img_data + i * 4;
+				img[i] = (p[3] << 24) | (p[0] << 16) | (p[1] << 8) | p[2];
+			}
 
-					// Convert RGBA to uint32_t
-					buffer[buf_idx] =
-					        (img_data[img_idx + 3] << 24) |
-					        (img_data[img_idx] << 16) |
-					        (img_data[img_idx + 1] << 8) |
-					        img_data[img_idx + 2];
+			// Tile the image, one row copy per repetition
+			for (uint32_t y = 0; y < height; y++) {
+				uint32_t* src = img + (y % img_height) * img_width;
+				uint32_t* dst = buffer + y * width;
+				for (uint32_t x = 0; x < width; x += img_width) {
+					uint32_t n = width - x < (uint32_t)img_width ? width - x : (uint32_t)img_width;
+					blit_copy_row(dst + x, src, n);
 				}
 			}
 		} else {
@@ -1,92 +1,66 @@
-/*
- * drm_dumb_cursor.c
- *
- * Minimal example showing how to:
- *  - initialize DRM
- *  - create dumb buffers (scanout + cursor)
- *  - use drmModeSetCrtc and drmModeSetCursor
- *
- * Build:
- *   gcc drm_dumb_cursor.c -o drm_dumb_cursor -ldrm
- *
- * Run (needs permissions to /dev/dri/cardX):
- *   sudo ./drm_dumb_cursor
- *
- * NOTE: This is example/demo code. Error handling tries to be good, but
- * real production code should be more thorough and handle more corner cases.
- */
-
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
 #include "server.h"
-#include <errno.h>
-#include <fcntl.h>
-#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
 #include <unistd.h>
 
-#include <drm/drm.h>
-#include <drm/drm_mode.h>
-#include <xf86drm.h>
-#include <xf86drmMode.h>
 #include <stb_image_write.h>
 
 extern struct ServerState server;
 
-int drm_fd = -1;
-uint32_t conn_id = 0;
-uint32_t cur_fb = 0;
-uint32_t cur_handle;
-uint64_t cur_size;
-void* cur_map;
-uint32_t scanout_handle;
-uint64_t scanout_size;
-drmModeConnector* connector = NULL;
-uint32_t fb_id = 0;
-drmModeRes* resources = NULL;
-drmModeEncoder* encoder = NULL;
-drmModeCrtc* saved_crtc = NULL;
-
-/* wrappers for ioctl structures (from drm_mode.h) */
-static int drm_create_dumb(int fd, uint32_t width, uint32_t height, uint32_t bpp,
-                           struct drm_mode_create_dumb* create) {
-	memset(create, 0, sizeof(*create));
-	create->width = width;
-	create->height = height;
-	create->bpp = bpp;
-	if (ioctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, create) < 0) {
-		perror("DRM_IOCTL_MODE_CREATE_DUMB");
+/*
+ * With more than one scanout buffer, or when asked for, compositing
+ * goes to a shadow copy in normal memory. Every buffer remembers which
+ * rows changed since it was last composed, see present_frame().
+ */
+static int init_shadow(struct config* config) {
+	if (!config->shadow && server.scanout_count == 1) {
+		return 0;
+	}
+	if (!config->shadow) {
+		printf("[BGCE] %d scanout buffers need the shadow framebuffer, enabling it\n",
+		       server.scanout_count);
+	}
+
+	/* Dumb buffers are often write-combined or uncached, compose in
+	 * normal memory and only stream finished rows to the scanout. Rows
+	 * are laid out like the scanout's so stale runs stay contiguous. */
+	size_t size = (size_t)server.pitch * server.display_h;
+	if (posix_memalign(&server.shadow, STRIDE_ALIGN, size) != 0) {
+		server.shadow = NULL;
+		perror("[BGCE] shadow framebuffer");
 		return -1;
 	}
-	return 0;
-}
-
-static int drm_map_dumb(int fd, uint32_t handle, uint64_t* offset) {
-	struct drm_mode_map_dumb map = {0};
-	map.handle = handle;
-	if (ioctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
-		perror("DRM_IOCTL_MODE_MAP_DUMB");
-		return -1;
+	memset(server.shadow, 0, size);
+	for (int i = 0; i < server.scanout_count; i++) {
+		struct ScanoutBuffer* b = &server.scanout[i];
+		b->stale_rows = calloc(server.display_h, 1);
+		if (!b->stale_rows) {
+			perror("[BGCE] shadow framebuffer");
+			return -1;
+		}
+		b->stale_y1 = server.display_h;
+		b->stale_y2 = 0;
+		b->stale_x1 = server.display_w;
+		b->stale_x2 = 0;
 	}
-	*offset = map.offset;
+	printf("[BGCE] Using shadow framebuffer\n");
 	return 0;
 }
 
-static int drm_destroy_dumb(int fd, uint32_t handle) {
-	struct drm_mode_destroy_dumb dest = {0};
-	dest.handle = handle;
-	if (ioctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dest) < 0) {
-		perror("DRM_IOCTL_MODE_DESTROY_DUMB");
-		return -1;
-	}
-	return 0;
+static int buffer_count(struct config* config) {
+	int n = config->buffers;
+	if (n < 1)
+		n = 1;
+	if (n > MAX_SCANOUT_BUFFERS)
+		n = MAX_SCANOUT_BUFFERS;
+	return n;
 }
 
-static void draw_cursor(uint8_t* buf, uint32_t stride, uint32_t w, uint32_t h) {
+void draw_cursor(uint8_t* buf, uint32_t stride, uint32_t w, uint32_t h) {
 	/* Cursor is ARGB8888 */
 	for (uint32_t y = 0; y < h; y++) {
 		uint32_t* line = (uint32_t*)(buf + y * stride);
@@ -105,481 +79,559 @@ static void draw_cursor(uint8_t* buf, uint32_t stride, uint32_t w, uint32_t h) {
 	}
 }
 
-int init_display() {
-	uint32_t crtc_id = 0;
-	drmModeModeInfo chosen_mode;
-	bool found = false;
+static const struct OutputBackend* backends[] = {
+        &drm_backend,
+        &headless_backend,
+};
 
-	const char* dri_card = "/dev/dri/card1";
-	drm_fd = open(dri_card, O_RDWR | O_CLOEXEC);
-	if (drm_fd < 0) {
-		perror("open drm device");
-		return 1;
+int init_display(struct config* config) {
+	const struct OutputBackend* backend = NULL;
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strcmp(backends[i]->name, config->backend) == 0)
+			backend = backends[i];
+	}
+	if (!backend) {
+		fprintf(stderr, "[BGCE] Unknown output backend %s\n", config->backend);
+		return -1;
 	}
-	server.drm_fd = drm_fd;
 
-	// if (setup_vt_handling() < 0) {
-	//	close(server->drm_fd);
-	//	return -1;
-	// }
+	server.backend = backend;
+	server.front = 0;
+	server.pending = -1;
+	server.queued = -1;
+	server.scanout_count = buffer_count(config);
+	printf("[BGCE] Using %s output, %d scanout buffers\n", backend->name, server.scanout_count);
 
-	resources = drmModeGetResources(drm_fd);
-	if (!resources) {
-		fprintf(stderr, "drmModeGetResources failed\n");
-		close(drm_fd);
-		return 1;
+	if (backend->init(&server, config) != 0) {
+		return -1;
 	}
+	server.framebuffer = server.scanout[0].map;
+	server.pitch = server.scanout[0].pitch;
 
-	/* Find first connected connector with at least one mode */
-	for (int i = 0; i < resources->count_connectors; i++) {
-		connector = drmModeGetConnector(drm_fd, resources->connectors[i]);
-		if (!connector)
-			continue;
-		if (connector->connection == DRM_MODE_CONNECTED && connector->count_modes > 0) {
-			/* choose first mode */
-			chosen_mode = connector->modes[0];
-			conn_id = connector->connector_id;
-			found = true;
-			break;
-		}
-		drmModeFreeConnector(connector);
-		connector = NULL;
-	}
-
-	if (!found) {
-		fprintf(stderr, "No connected connector with modes found\n");
-		drmModeFreeResources(resources);
-		close(drm_fd);
-		return 1;
-	}
-
-	/* Try to find an encoder and CRTC */
-	if (connector->encoder_id)
-		encoder = drmModeGetEncoder(drm_fd, connector->encoder_id);
-
-	if (encoder && encoder->crtc_id) {
-		crtc_id = encoder->crtc_id;
-	} else {
-		/* fallback: choose any possible CRTC from resources */
-		for (int i = 0; i < resources->count_encoders; i++) {
-			drmModeEncoder* enc = drmModeGetEncoder(drm_fd, resources->encoders[i]);
-			if (!enc)
-				continue;
-			/* pick first crtc that exists */
-			for (int c = 0; c < resources->count_crtcs; c++) {
-				uint32_t possible = enc->possible_crtcs;
-				if (possible & (1 << c)) {
-					crtc_id = resources->crtcs[c];
-					break;
-				}
-			}
-			drmModeFreeEncoder(enc);
-			if (crtc_id)
-				break;
-		}
-	}
+	return init_shadow(config);
+}
 
-	if (!crtc_id) {
-		fprintf(stderr, "Failed to find a suitable CRTC\n");
-		drmModeFreeConnector(connector);
-		drmModeFreeResources(resources);
-		close(drm_fd);
-		return 1;
-	}
+void release_display(void) {
+	if (server.backend)
+		server.backend->release(&server);
 
-	/* Save current CRTC to restore later */
-	saved_crtc = drmModeGetCrtc(drm_fd, crtc_id);
-	if (!saved_crtc) {
-		fprintf(stderr, "drmModeGetCrtc failed\n");
-		/* continue anyway, but we'll try to restore nothing */
-	}
+	for (int i = 0; i < server.scanout_count; i++)
+		free(server.scanout[i].stale_rows);
+	memset(server.scanout, 0, sizeof(server.scanout));
+	server.scanout_count = 0;
+	server.framebuffer = NULL;
 
-	uint32_t width = chosen_mode.hdisplay;
-	uint32_t height = chosen_mode.vdisplay;
-	uint32_t bpp = 32; /* use 32bpp for scanout */
-	server.crtc_id = crtc_id;
-	server.display_w = chosen_mode.hdisplay;
-	server.display_h = chosen_mode.vdisplay;
-	server.display_bpp = bpp;
+	free(server.shadow);
+	server.shadow = NULL;
+	printf("[BGCE] Display released.\n");
+}
 
-	printf("[BGCE] Setting up connector %u, CRTC %u, mode %ux%u@%u\n",
-	       conn_id, crtc_id, width, height, chosen_mode.vrefresh);
+void move_cursor(struct ServerState* srv, int x, int y) {
+	if (srv->backend)
+		srv->backend->move_cursor(srv, x, y);
+}
 
-	/* ---------- Create dumb scanout buffer ---------- */
-	struct drm_mode_create_dumb create = {0};
-	if (drm_create_dumb(drm_fd, width, height, bpp, &create) < 0) {
-		fprintf(stderr, "Failed to create dumb buffer for scanout\n");
-		return -1;
-	}
-	scanout_handle = create.handle;
-	scanout_size = create.size;
-	uint32_t scanout_pitch = create.pitch;
+static struct Rect client_rect(const struct Client* c) {
+	struct Rect r = {c->x, c->y, c->x + (int32_t)c->width, c->y + (int32_t)c->height};
+	return r;
+}
 
-	/* allocate map */
-	uint64_t scanout_offset;
-	if (drm_map_dumb(drm_fd, scanout_handle, &scanout_offset) < 0) {
-		fprintf(stderr, "Failed to map dumb buffer for scanout\n");
-		return -1;
+/*
+ * Compositing splits the damaged area into tiles that the worker pool
+ * paints in parallel. Tiles are aligned to the screen and wide enough
+ * that rows are long runs for the copy kernels.
+ */
+#define TILE_WIDTH 256
+#define TILE_HEIGHT 64
+
+/* The area r of the shadow changed, no scanout buffer has it yet */
+static void mark_stale(struct ServerState* srv, struct Rect r) {
+	for (int i = 0; i < srv->scanout_count; i++) {
+		struct ScanoutBuffer* b = &srv->scanout[i];
+		memset(b->stale_rows + r.y1, 1, r.y2 - r.y1);
+		if ((uint32_t)r.y1 < b->stale_y1)
+			b->stale_y1 = r.y1;
+		if ((uint32_t)r.y2 > b->stale_y2)
+			b->stale_y2 = r.y2;
+		if ((uint32_t)r.x1 < b->stale_x1)
+			b->stale_x1 = r.x1;
+		if ((uint32_t)r.x2 > b->stale_x2)
+			b->stale_x2 = r.x2;
 	}
+}
 
-	server.framebuffer = mmap(NULL, scanout_size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_fd, scanout_offset);
-	if (server.framebuffer == MAP_FAILED) {
-		perror("mmap scanout");
-		return -1;
+/*
+ * Copy the screen area r, which must lie inside the client, to the
+ * framebuffer. Clients not declared opaque are blended over what is
+ * already there. Safe to run in parallel for disjoint areas, the
+ * caller marks the rows stale.
+ */
+static void blit_client_rect(struct ServerState* srv, const struct Client* cli, struct Rect r) {
+	size_t fb_stride = srv->pitch;
+	size_t src_stride = cli->stride;
+	uint8_t* src = (uint8_t*)cli->buffer + (r.y1 - cli->y) * src_stride + (r.x1 - cli->x) * BGCE_BYTES_PER_PIXEL;
+	int opaque = cli->flags & BGCE_BUFFER_OPAQUE;
+
+	if (!srv->shadow) {
+		/* Straight to the scanout, which is only read back to blend */
+		uint8_t* dst = (uint8_t*)srv->framebuffer + r.y1 * fb_stride + r.x1 * BGCE_BYTES_PER_PIXEL;
+		if (opaque)
+			blit_copy_rect_nt(dst, fb_stride, src, src_stride, r.x2 - r.x1, r.y2 - r.y1);
+		else
+			blit_blend_rect(dst, fb_stride, src, src_stride, r.x2 - r.x1, r.y2 - r.y1);
+		return;
 	}
 
-	/* Clear/draw content */
-	memset(server.framebuffer, 0x00, scanout_size);
-
-	/* Create framebuffer object for scanout.
-	 * Prefer drmModeAddFB2 (for specifying pixel-format), fallback to drmModeAddFB.
-	 */
-	bool fb2_ok = false;
-#ifdef DRM_FORMAT_ARGB8888
-	/* try adb2 path */
-	{
-		uint32_t handles[4] = {scanout_handle, 0, 0, 0};
-		uint32_t pitches[4] = {scanout_pitch, 0, 0, 0};
-		uint32_t offsets[4] = {0, 0, 0, 0};
-		uint32_t format = DRM_FORMAT_XRGB8888; /* scanout content uses XRGB (no alpha) */
-		if (drmModeAddFB2(drm_fd, width, height, format, handles, pitches, offsets, &fb_id, 0) == 0) {
-			fb2_ok = true;
-		} else {
-			/* drmModeAddFB2 may fail on older drivers; we'll fallback */
-			fb2_ok = false;
-		}
-	}
-#endif
+	uint8_t* dst = (uint8_t*)srv->shadow + r.y1 * fb_stride + r.x1 * BGCE_BYTES_PER_PIXEL;
+	if (opaque)
+		blit_copy_rect(dst, fb_stride, src, src_stride, r.x2 - r.x1, r.y2 - r.y1);
+	else
+		blit_blend_rect(dst, fb_stride, src, src_stride, r.x2 - r.x1, r.y2 - r.y1);
+}
 
-	if (!fb2_ok) {
-		/* compute depth and bpp for legacy call */
-		uint32_t depth = 24;
-		if (drmModeAddFB(drm_fd, width, height, depth, bpp, scanout_pitch, scanout_handle, &fb_id) != 0) {
-			fprintf(stderr, "drmModeAddFB failed\n");
-			return -1;
+struct CopyForward {
+	struct ServerState* srv;
+	struct ScanoutBuffer* b;
+	uint32_t x; /* columns to copy */
+	uint32_t width;
+};
+
+/* Copy the stale rows of one band of TILE_HEIGHT rows */
+static void copy_forward_band(void* arg, int job) {
+	struct CopyForward* cf = arg;
+	struct ServerState* srv = cf->srv;
+	struct ScanoutBuffer* b = cf->b;
+	size_t x = cf->x * BGCE_BYTES_PER_PIXEL;
+
+	uint32_t y = b->stale_y1 + job * TILE_HEIGHT;
+	uint32_t end = y + TILE_HEIGHT < b->stale_y2 ? y + TILE_HEIGHT : b->stale_y2;
+	while (y < end) {
+		if (!b->stale_rows[y]) {
+			y++;
+			continue;
 		}
-	}
 
-	/* ---------- Create dumb cursor buffer (small ARGB) ---------- */
+		uint32_t start = y;
+		while (y < end && b->stale_rows[y])
+			y++;
 
-	struct drm_mode_create_dumb cur_create = {0};
-	if (drm_create_dumb(drm_fd, CURSOR_WIDTH, CURSOR_HEIGHT, 32, &cur_create) < 0) {
-		fprintf(stderr, "Failed to create dumb buffer for cursor\n");
-		return -1;
+		memset(b->stale_rows + start, 0, y - start);
+		blit_copy_rect_nt((uint8_t*)b->map + start * b->pitch + x, b->pitch,
+		                  (uint8_t*)srv->shadow + start * srv->pitch + x, srv->pitch,
+		                  cf->width, y - start);
 	}
-	cur_handle = cur_create.handle;
-	cur_size = cur_create.size;
+}
 
-	uint64_t cur_offset;
-	uint32_t cur_pitch = cur_create.pitch;
-	if (drm_map_dumb(drm_fd, cur_handle, &cur_offset) < 0) {
-		fprintf(stderr, "Failed to map dumb cursor\n");
-		return -1;
-	}
-	cur_map = mmap(NULL, cur_size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_fd, cur_offset);
-	if (cur_map == MAP_FAILED) {
-		perror("mmap cursor");
-		return -1;
+/*
+ * Bring the scanout buffer up to date with the shadow by copying the
+ * rows that changed since it was last composed, within the columns
+ * that changed. When those span the screen the padding goes along:
+ * the pitches match, so consecutive stale rows are one contiguous
+ * block and each run is a single sequential streaming copy. Small
+ * updates, like a blinking cursor, only copy their cache lines. Bands
+ * of rows go to the workers.
+ */
+static void copy_forward(struct ServerState* srv, struct ScanoutBuffer* b) {
+	if (b->stale_y1 >= b->stale_y2 || b->stale_x1 >= b->stale_x2) {
+		/* Brought up to date while a flip was pending */
+		b->composed = srv->composed;
+		return;
 	}
-	memset(cur_map, 0, cur_size);
 
-	draw_cursor((uint8_t*)cur_map, cur_pitch, CURSOR_WIDTH, CURSOR_HEIGHT);
+	/* Whole cache lines, write-combining flushes those in one go */
+	uint32_t line = STRIDE_ALIGN / BGCE_BYTES_PER_PIXEL;
+	uint32_t x1 = b->stale_x1 / line * line;
+	uint32_t x2 = (b->stale_x2 + line - 1) / line * line;
+	if ((x1 == 0 && x2 >= srv->display_w) || x2 > srv->pitch / BGCE_BYTES_PER_PIXEL)
+		x2 = srv->pitch / BGCE_BYTES_PER_PIXEL;
 
-#ifdef DRM_FORMAT_ARGB8888
-	{
-		uint32_t handles[4] = {cur_handle, 0, 0, 0};
-		uint32_t pitches[4] = {cur_pitch, 0, 0, 0};
-		uint32_t offsets[4] = {0, 0, 0, 0};
-		uint32_t format = DRM_FORMAT_ARGB8888;
-		if (drmModeAddFB2(drm_fd, cur_w, cur_h, format, handles, pitches, offsets, &cur_fb, 0) != 0) {
-			fprintf(stderr, "drmModeAddFB2 for cursor failed, trying legacy\n");
-			cur_fb = 0;
-		}
-	}
-#endif
-	if (!cur_fb) {
-		/* Legacy fb creation for cursor might not support alpha; still try */
-		uint32_t depth = 24;
-		if (drmModeAddFB(drm_fd, CURSOR_WIDTH, CURSOR_HEIGHT, depth, 32, cur_pitch, cur_handle, &cur_fb) != 0) {
-			fprintf(stderr, "drmModeAddFB for cursor failed\n");
-			return -1;
-		}
-	}
+	struct CopyForward cf = {srv, b, x1, x2 - x1};
+	int bands = (b->stale_y2 - b->stale_y1 + TILE_HEIGHT - 1) / TILE_HEIGHT;
+	run_parallel(copy_forward_band, &cf, bands);
 
-	/* ---------- Set CRTC (scanout) ---------- */
-	if (drmModeSetCrtc(drm_fd, crtc_id, fb_id, 0, 0, &conn_id, 1, &chosen_mode) != 0) {
-		fprintf(stderr, "drmModeSetCrtc failed: %s\n", strerror(errno));
-		return -1;
-	}
+	b->stale_y1 = srv->display_h;
+	b->stale_y2 = 0;
+	b->stale_x1 = srv->display_w;
+	b->stale_x2 = 0;
+	b->composed = srv->composed;
+}
 
-	/* ---------- Set cursor ---------- */
-	if (drmModeSetCursor(drm_fd, crtc_id, cur_handle, CURSOR_WIDTH, CURSOR_HEIGHT) != 0) {
-		fprintf(stderr, "drmModeSetCursor failed: %s\n", strerror(errno));
-		/* keep going — maybe hardware doesn't support cursor */
-	} else {
-		/* move cursor to near center */
-		if (drmModeMoveCursor(drm_fd, crtc_id, width / 2, height / 2) != 0) {
-			fprintf(stderr, "drmModeMoveCursor failed\n");
-		}
+/* Pick the buffer that has been off screen the longest */
+static int oldest_buffer(struct ServerState* srv) {
+	int back = -1;
+	for (int i = 0; i < srv->scanout_count; i++) {
+		if (i == srv->front || i == srv->pending)
+			continue;
+		if (back < 0 || srv->scanout[i].frame < srv->scanout[back].frame)
+			back = i;
 	}
-
-	return 0;
+	return back;
 }
 
-void draw(struct ServerState* srv, struct Client cli) {
-	if (!srv || !srv->framebuffer || !cli.buffer) {
-		fprintf(stderr, "Draw: Invalid server, framebuffer, or client buffer\n");
+/* Everything up to composition composed is on screen, lock held */
+static void frame_shown(struct ServerState* srv, uint64_t composed, const struct timespec* when) {
+	if (composed <= srv->presented)
 		return;
+	srv->presented = composed;
+	if (when)
+		srv->presented_at = *when;
+	else
+		clock_gettime(CLOCK_MONOTONIC, &srv->presented_at);
+	latency_shown_locked(composed, &srv->presented_at);
+	srv->shown++;
+
+	/* Decided here, by what this flip shows, not what is queued */
+	int due = 0;
+	for (struct Client* c = srv->clients; c; c = c->next) {
+		if (c->frame_target && c->frame_target <= composed) {
+			c->frame_target = 0;
+			c->frame_due = 1;
+			due = 1;
+		}
 	}
+	if (due)
+		wake_frame_callbacks(srv);
+}
 
-	uint32_t screen_w = srv->display_w;
-	uint32_t screen_h = srv->display_h;
-
-	uint32_t client_w = cli.width;
-	uint32_t client_h = cli.height;
-
-	int cx = cli.x;
-	int cy = cli.y;
-
-	uint32_t* dst = (uint32_t*)srv->framebuffer;
-	uint32_t* src = (uint32_t*)cli.buffer;
+static void page_flip(struct ServerState* srv, int back) {
+	struct ScanoutBuffer* b = &srv->scanout[back];
+	srv->frame++;
+	b->frame = srv->frame;
+	srv->pending = back;
 
-	/* ---------------- Clip Region ---------------- */
+	if (srv->backend->flip(srv, back) != 0) {
+		/* Shown right away, no completion will come */
+		srv->front = back;
+		srv->pending = -1;
+		frame_shown(srv, b->composed, NULL);
+	}
+}
 
-	int start_x = cx < 0 ? 0 : cx;
-	int start_y = cy < 0 ? 0 : cy;
+/*
+ * Get what was composed into the shadow on screen, caller holds the
+ * lock. With one buffer the stale rows go straight to the scanout.
+ * Otherwise they go to a back buffer which is then flipped; while a
+ * flip is in flight a third buffer, if any, is prepared ahead and the
+ * next flip happens once the pending one completes.
+ */
+static void present_frame(struct ServerState* srv) {
+	if (!srv->shadow) {
+		/* composed straight into the scanout */
+		frame_shown(srv, srv->composed, NULL);
+		return;
+	}
 
-	int end_x = cx + client_w;
-	int end_y = cy + client_h;
+	struct ScanoutBuffer* front = &srv->scanout[srv->front];
+	if (front->stale_y1 >= front->stale_y2) {
+		return; /* nothing new since the front buffer was composed */
+	}
 
-	if (end_x > (int)screen_w)
-		end_x = screen_w;
-	if (end_y > (int)screen_h)
-		end_y = screen_h;
+	if (srv->scanout_count == 1) {
+		copy_forward(srv, front);
+		frame_shown(srv, front->composed, NULL);
+		return;
+	}
 
-	/* Entire window is outside screen */
-	if (start_x >= end_x || start_y >= end_y) {
-		fprintf(stderr, "Draw: Client entirely outside screen\n");
+	if (srv->pending >= 0) {
+		if (srv->queued < 0)
+			srv->queued = oldest_buffer(srv);
+		if (srv->queued >= 0)
+			copy_forward(srv, &srv->scanout[srv->queued]);
 		return;
 	}
 
-	int src_start_x = start_x - cx;
-	int src_start_y = start_y - cy;
+	int back = srv->queued >= 0 ? srv->queued : oldest_buffer(srv);
+	srv->queued = -1;
+	copy_forward(srv, &srv->scanout[back]);
+	page_flip(srv, back);
+}
 
-	int copy_w = end_x - start_x;
-	int copy_h = end_y - start_y;
+void display_flip_done(struct ServerState* srv, const struct timespec* when) {
+	pthread_mutex_lock(&srv->lock);
+	if (srv->pending >= 0) {
+		srv->front = srv->pending;
+		srv->pending = -1;
+		frame_shown(srv, srv->scanout[srv->front].composed, when);
+		present_frame(srv);
+	}
+	pthread_mutex_unlock(&srv->lock);
+}
 
-	uint32_t screen_stride_pixels = screen_w; /* No stride stored → compute */
+int display_event_fd(void) {
+	return server.backend ? server.backend->event_fd(&server) : -1;
+}
 
-	/* ------------- Copy to DRM FB --------------- */
+void display_dispatch(struct ServerState* srv) {
+	srv->backend->dispatch(srv);
+}
 
-	for (int y = 0; y < copy_h; y++) {
-		uint32_t* drow = dst + (start_y + y) * screen_stride_pixels + start_x;
-		uint32_t* srow = src + (src_start_y + y) * client_w + src_start_x;
-		memcpy(drow, srow, copy_w * 4);
+/*
+ * The client committed new content, the next composition shows it. A
+ * callback still waiting answers later requests too, moving it on
+ * would starve a client that commits faster than frames are shown.
+ */
+static void commit_locked(struct ServerState* srv, struct Client* c) {
+	if (c->frame_requested) {
+		c->frame_requested = 0;
+		if (!c->frame_target)
+			c->frame_target = srv->composed + 1;
+	}
+	if (c->input_ns) {
+		/* The client's answer to the input it was sent */
+		record_latency(BGCE_LATENCY_COMMIT, c->input_ns);
+		latency_damage_locked(c->input_ns);
+		c->input_ns = 0;
 	}
 }
 
 /*
- * The situation:
- *
- * dx<0:                             dx>0:  . (x,y)
- * dy<0:  +----------------+         dy>0:  +----------------+
- *        |     (x,y)      | dx             |     rect A     | dy
- *        |    .           +----+           +----+-----------+----+
- *        |                |    |           |    |                |
- *        |                |    |           |    |                |
- *        |                |    |           |    |                |
- *        |                | B  |           |  B |                |
- *        +----+-----------+----+           +----+                |
- *          dy |     rect A     |             dx |                |
- *             +----------------+                +----------------+
- *
- * So we redraw the rectangles:
- * A: (x, y) (x+width, y+dy) and
- * B: (x, y+dy) (x+dx, y+height)
+ * Repaint the parts of the client no other window covers, in the next
+ * frame. Going through the compositor keeps blending right: what is
+ * below gets repainted first, translucent windows above are blended
+ * again.
  */
-void redraw_region(struct ServerState* srv, struct Client c, int dx, int dy) {
-	if (!srv || !srv->framebuffer) {
-		fprintf(stderr, "Redraw: Invalid server, framebuffer, or client\n");
+void draw(struct ServerState* srv, struct Client* cli) {
+	if (!srv || !srv->framebuffer || !cli || !cli->buffer) {
+		fprintf(stderr, "Draw: Invalid server, framebuffer, or client buffer\n");
 		return;
 	}
 
-	uint32_t width = c.width;
-	uint32_t height = c.height;
-	uint32_t screen_w = srv->display_w;
-	uint32_t screen_h = srv->display_h;
-
-	/* Rectangle A: Exposed area in y-direction */
-	int rect_a_start_x = c.x;
-	int rect_a_start_y = dy > 0 ? c.y : c.y + height + dy;
-	int rect_a_end_x = c.x + width;
-	int rect_a_end_y = dy > 0 ? c.y + dy : c.y + height;
-
-	/* Rectangle B: Exposed area in x-direction */
-	int rect_b_start_x = dx > 0 ? c.x : c.x + width + dx;
-	int rect_b_start_y = c.y + (dy > 0 ? dy : 0);
-	int rect_b_end_x = dx > 0 ? c.x + dx : c.x + width;
-	int rect_b_end_y = c.y + height + (dy > 0 ? dy : 0);
-
-	/* Clip rectangles to screen boundaries */
-	rect_a_start_x = rect_a_start_x < 0 ? 0 : rect_a_start_x;
-	rect_a_start_y = rect_a_start_y < 0 ? 0 : rect_a_start_y;
-	rect_a_end_x = rect_a_end_x > (int)screen_w ? screen_w : rect_a_end_x;
-	rect_a_end_y = rect_a_end_y > (int)screen_h ? screen_h : rect_a_end_y;
-
-	rect_b_start_x = rect_b_start_x < 0 ? 0 : rect_b_start_x;
-	rect_b_start_y = rect_b_start_y < 0 ? 0 : rect_b_start_y;
-	rect_b_end_x = rect_b_end_x > (int)screen_w ? screen_w : rect_b_end_x;
-	rect_b_end_y = rect_b_end_y > (int)screen_h ? screen_h : rect_b_end_y;
-
-	struct Client* cli = c.next;
-	while (cli) {
-		/* Redraw Rectangle A */
-		if (dy) {
-			int cli_end_x = cli->x + cli->width;
-			int cli_end_y = cli->y + cli->height;
-
-			int overlap_start_x = rect_a_start_x > cli->x ? rect_a_start_x : cli->x;
-			int overlap_start_y = rect_a_start_y > cli->y ? rect_a_start_y : cli->y;
-
-			int overlap_end_x = rect_a_end_x < cli_end_x ? rect_a_end_x : cli_end_x;
-			int overlap_end_y = rect_a_end_y < cli_end_y ? rect_a_end_y : cli_end_y;
-
-			if (overlap_start_x < overlap_end_x && overlap_start_y < overlap_end_y) {
-				for (int y = overlap_start_y; y < overlap_end_y; y++) {
-					uint32_t* drow = (uint32_t*)srv->framebuffer + y * screen_w + overlap_start_x;
-					uint32_t* srow = (uint32_t*)cli->buffer + (y - cli->y) * cli->width + (overlap_start_x - cli->x);
-					memcpy(drow, srow, (overlap_end_x - overlap_start_x) * 4);
-				}
-			}
-		}
-
-		/* Redraw Rectangle B */
-		if (dx) {
-			int cli_end_x = cli->x + cli->width;
-			int cli_end_y = cli->y + cli->height;
+	pthread_mutex_lock(&srv->lock);
+	region_union(&srv->damage, &cli->visible);
+	commit_locked(srv, cli);
+	pthread_mutex_unlock(&srv->lock);
 
-			int overlap_start_x = rect_b_start_x > cli->x ? rect_b_start_x : cli->x;
-			int overlap_start_y = rect_b_start_y > cli->y ? rect_b_start_y : cli->y;
+	schedule_frame(srv);
+}
 
-			int overlap_end_x = rect_b_end_x < cli_end_x ? rect_b_end_x : cli_end_x;
-			int overlap_end_y = rect_b_end_y < cli_end_y ? rect_b_end_y : cli_end_y;
+/*
+ * Recompute what every client shows of itself. Walking the stack from
+ * the top, each client gets its on-screen rectangle minus the opaque
+ * windows above it; translucent windows hide nothing.
+ */
+static void update_visibility_locked(struct ServerState* srv) {
+	struct Rect screen = {0, 0, srv->display_w, srv->display_h};
+	struct Region covered;
+	region_init(&covered);
+
+	for (struct Client* c = srv->clients; c; c = c->next) {
+		region_clear(&c->visible);
+		if (!c->buffer)
+			continue;
 
-			if (overlap_start_x < overlap_end_x && overlap_start_y < overlap_end_y) {
-				for (int y = overlap_start_y; y < overlap_end_y; y++) {
-					uint32_t* drow = (uint32_t*)srv->framebuffer + y * screen_w + overlap_start_x;
-					uint32_t* srow = (uint32_t*)cli->buffer + (y - cli->y) * cli->width + (overlap_start_x - cli->x);
-					memcpy(drow, srow, (overlap_end_x - overlap_start_x) * 4);
-				}
-			}
-		}
-		cli = cli->next;
+		struct Rect r = rect_intersect(client_rect(c), screen);
+		region_union_rect(&c->visible, r);
+		region_subtract(&c->visible, &covered);
+		if (c->flags & BGCE_BUFFER_OPAQUE)
+			region_union_rect(&covered, r);
 	}
+
+	region_fini(&covered);
 }
 
-static void redraw_exposed_rect(struct ServerState* srv, const struct Client* resized_client,
-                                int exposed_x, int exposed_y, int exposed_width, int exposed_height) {
-	if (exposed_width <= 0 || exposed_height <= 0) {
-		return; // Nothing to draw
-	}
+void update_visibility(struct ServerState* srv) {
+	pthread_mutex_lock(&srv->lock);
+	update_visibility_locked(srv);
+	pthread_mutex_unlock(&srv->lock);
+}
 
-	uint32_t screen_w = srv->display_w;
+static void damage_rect_locked(struct ServerState* srv, struct Rect r) {
+	struct Rect screen = {0, 0, srv->display_w, srv->display_h};
+	region_union_rect(&srv->damage, rect_intersect(r, screen));
+}
 
-	// Now, iterate through clients behind the resized_client and draw them if they overlap
-	struct Client* cli = resized_client->next;
-	while (cli) {
-		// Calculate overlap between the exposed rectangle and the current client 'cli'
-		int cli_end_x = cli->x + cli->width;
-		int cli_end_y = cli->y + cli->height;
+void damage_rect(struct ServerState* srv, struct Rect r) {
+	pthread_mutex_lock(&srv->lock);
+	damage_rect_locked(srv, r);
+	pthread_mutex_unlock(&srv->lock);
+}
 
-		int overlap_start_x = exposed_x > cli->x ? exposed_x : cli->x;
-		int overlap_start_y = exposed_y > cli->y ? exposed_y : cli->y;
+void damage_client(struct ServerState* srv, const struct Client* c) {
+	damage_rect(srv, client_rect(c));
+}
 
-		int overlap_end_x = (exposed_x + exposed_width) < cli_end_x ? (exposed_x + exposed_width) : cli_end_x;
-		int overlap_end_y = (exposed_y + exposed_height) < cli_end_y ? (exposed_y + exposed_height) : cli_end_y;
+/*
+ * Geometry and buffers only change under the lock, together with the
+ * visible regions, so the compositor never paints a client with
+ * regions computed for another position or size.
+ */
+void move_client(struct ServerState* srv, struct Client* c, int32_t x, int32_t y) {
+	pthread_mutex_lock(&srv->lock);
+	damage_rect_locked(srv, client_rect(c));
+	c->x = x;
+	c->y = y;
+	update_visibility_locked(srv);
+	damage_rect_locked(srv, client_rect(c));
+	pthread_mutex_unlock(&srv->lock);
+	grid_update(c);
+}
 
-		if (overlap_start_x < overlap_end_x && overlap_start_y < overlap_end_y) {
-			// There's an overlap, copy from client's buffer to framebuffer
-			for (int y = overlap_start_y; y < overlap_end_y; y++) {
-				uint32_t* drow = (uint32_t*)srv->framebuffer + y * screen_w + overlap_start_x;
-				uint32_t* srow = (uint32_t*)cli->buffer + (y - cli->y) * cli->width + (overlap_start_x - cli->x);
-				memcpy(drow, srow, (overlap_end_x - overlap_start_x) * 4);
-			}
-		}
-		cli = cli->next;
-	}
+void* swap_client_buffer(struct ServerState* srv, struct Client* c, void* buffer,
+                         uint32_t width, uint32_t height, uint32_t stride, uint32_t flags) {
+	pthread_mutex_lock(&srv->lock);
+	void* old = c->buffer;
+	if (old)
+		damage_rect_locked(srv, client_rect(c));
+	c->buffer = buffer;
+	c->width = width;
+	c->height = height;
+	c->stride = stride;
+	c->flags = flags;
+	update_visibility_locked(srv);
+	damage_rect_locked(srv, client_rect(c));
+	pthread_mutex_unlock(&srv->lock);
+	grid_update(c);
+	return old;
 }
 
-void redraw_from_resize(struct ServerState* srv, struct Client c, int dx, int dy) {
-	if (!srv || !srv->framebuffer) {
-		fprintf(stderr, "Redraw from resize: Invalid server or framebuffer\n");
+void draw_rects(struct ServerState* srv, struct Client* cli, const struct BGCERect* rects, size_t n) {
+	if (!cli->buffer)
 		return;
+
+	/* Clip to the buffer first, the sizes come from the client */
+	struct Region changed;
+	region_init(&changed);
+	for (size_t i = 0; i < n; i++) {
+		int64_t x1 = rects[i].x > 0 ? rects[i].x : 0;
+		int64_t y1 = rects[i].y > 0 ? rects[i].y : 0;
+		int64_t x2 = (int64_t)rects[i].x + rects[i].width;
+		int64_t y2 = (int64_t)rects[i].y + rects[i].height;
+		if (x2 > cli->width)
+			x2 = cli->width;
+		if (y2 > cli->height)
+			y2 = cli->height;
+		if (x1 >= x2 || y1 >= y2)
+			continue;
+
+		struct Rect r = {cli->x + x1, cli->y + y1, cli->x + x2, cli->y + y2};
+		region_union_rect(&changed, r);
 	}
 
-	// Calculate the client's old dimensions
-	int old_width = c.width - dx;
-	int old_height = c.height - dy;
+	pthread_mutex_lock(&srv->lock);
+	region_intersect(&changed, &cli->visible);
+	region_union(&srv->damage, &changed);
+	commit_locked(srv, cli);
+	pthread_mutex_unlock(&srv->lock);
+	region_fini(&changed);
 
-	// Handle horizontal shrinkage (area on the right)
-	if (dx < 0) {
-		int exposed_x = c.x + c.width; // Start of the exposed area
-		int exposed_y = c.y;
-		int exposed_width = -dx;       // The amount it shrunk
-		int exposed_height = old_height; // This should be the old height
+	schedule_frame(srv);
+}
 
-		redraw_exposed_rect(srv, &c, exposed_x, exposed_y, exposed_width, exposed_height);
-	}
+void* present_client_buffer(struct ServerState* srv, struct Client* c, void* buffer) {
+	pthread_mutex_lock(&srv->lock);
+	void* old = c->buffer;
+	c->buffer = buffer;
+	region_union(&srv->damage, &c->visible);
+	commit_locked(srv, c);
+	pthread_mutex_unlock(&srv->lock);
 
-	// Handle vertical shrinkage (area at the bottom)
-	if (dy < 0) {
-		int exposed_x = c.x;
-		int exposed_y = c.y + c.height; // Start of the exposed area
-		int exposed_width = old_width;   // This should be the old width
-		int exposed_height = -dy;       // The amount it shrunk
+	schedule_frame(srv);
+	return old;
+}
 
-		redraw_exposed_rect(srv, &c, exposed_x, exposed_y, exposed_width, exposed_height);
+/* Everything one compositing pass needs, shared by the tile jobs */
+struct Composition {
+	struct ServerState* srv;
+	struct Client** stack; /* top to bottom */
+	struct Region* paint;  /* damaged part of each visible region */
+	size_t n;
+	int32_t x0, y0; /* first tile */
+	int cols;
+};
+
+/* Paint one tile, clients bottom-to-top */
+static void composite_tile(void* arg, int job) {
+	struct Composition* comp = arg;
+	int32_t x = comp->x0 + (job % comp->cols) * TILE_WIDTH;
+	int32_t y = comp->y0 + (job / comp->cols) * TILE_HEIGHT;
+	struct Rect tile = {x, y, x + TILE_WIDTH, y + TILE_HEIGHT};
+
+	for (size_t i = comp->n; i--;) {
+		struct Region* paint = &comp->paint[i];
+		for (size_t k = 0; k < paint->count; k++) {
+			struct Rect r = rect_intersect(paint->rects[k], tile);
+			if (r.x1 < r.x2)
+				blit_client_rect(comp->srv, comp->stack[i], r);
+		}
 	}
 }
 
-void release_display(void) {
-	if (cur_fb)
-		drmModeRmFB(drm_fd, cur_fb);
+/*
+ * Repaint the accumulated damage. Clients are painted bottom-to-top,
+ * so every translucent pixel is blended over a freshly painted opaque
+ * one. Without translucent windows the visible regions partition the
+ * screen and each damaged pixel is written once.
+ *
+ * Tiles never overlap, so each is painted by a single worker in the
+ * right order and no locking is needed between them.
+ */
+void composite_damage(struct ServerState* srv) {
+	if (!srv || !srv->framebuffer) {
+		fprintf(stderr, "Composite: Invalid server or framebuffer\n");
+		return;
+	}
 
-	if (cur_map && cur_map != MAP_FAILED)
-		munmap(cur_map, cur_size);
+	pthread_mutex_lock(&srv->lock);
+	if (region_empty(&srv->damage)) {
+		pthread_mutex_unlock(&srv->lock);
+		return;
+	}
+	if (srv->frames_held) {
+		/* A transaction came in since the frame was scheduled, it
+		 * is painted once release_frames() lets it through */
+		srv->frame_requested = 1;
+		pthread_mutex_unlock(&srv->lock);
+		return;
+	}
 
-	if (cur_handle)
-		drm_destroy_dumb(drm_fd, cur_handle);
+	size_t n = 0;
+	for (struct Client* c = srv->clients; c; c = c->next)
+		n++;
 
-	if (fb_id)
-		drmModeRmFB(drm_fd, fb_id);
+	struct Composition comp = {.srv = srv, .n = n};
+	comp.stack = calloc(n, sizeof(struct Client*));
+	comp.paint = calloc(n, sizeof(struct Region));
+	if (!comp.stack || !comp.paint) {
+		perror("[BGCE] composite alloc");
+		pthread_mutex_unlock(&srv->lock);
+		free(comp.stack);
+		free(comp.paint);
+		return;
+	}
 
-	if (server.framebuffer && server.framebuffer != MAP_FAILED)
-		munmap(server.framebuffer, scanout_size);
+	size_t i = 0;
+	for (struct Client* c = srv->clients; c; c = c->next, i++) {
+		comp.stack[i] = c;
+		region_init(&comp.paint[i]);
+		if (region_empty(&c->visible))
+			continue;
+		region_copy(&comp.paint[i], &srv->damage);
+		region_intersect(&comp.paint[i], &c->visible);
+	}
 
-	if (scanout_handle)
-		drm_destroy_dumb(drm_fd, scanout_handle);
+	struct Rect ext = region_extents(&srv->damage);
+	comp.x0 = ext.x1 / TILE_WIDTH * TILE_WIDTH;
+	comp.y0 = ext.y1 / TILE_HEIGHT * TILE_HEIGHT;
+	comp.cols = (ext.x2 - comp.x0 + TILE_WIDTH - 1) / TILE_WIDTH;
+	int rows = (ext.y2 - comp.y0 + TILE_HEIGHT - 1) / TILE_HEIGHT;
+	run_parallel(composite_tile, &comp, comp.cols * rows);
 
-	/* restore saved CRTC if we have it */
-	if (saved_crtc) {
-		drmModeSetCrtc(drm_fd, saved_crtc->crtc_id,
-		               saved_crtc->buffer_id,
-		               saved_crtc->x, saved_crtc->y,
-		               &conn_id, 1,
-		               &saved_crtc->mode);
-		drmModeFreeCrtc(saved_crtc);
+	if (srv->shadow) {
+		for (size_t k = 0; k < srv->damage.count; k++)
+			mark_stale(srv, srv->damage.rects[k]);
 	}
 
-	if (connector)
-		drmModeFreeConnector(connector);
-	if (resources)
-		drmModeFreeResources(resources);
-	if (encoder)
-		drmModeFreeEncoder(encoder);
+	/* Anything not visible on a client is not covered by any window */
+	region_clear(&srv->damage);
+	srv->composed++;
+	latency_composed_locked(srv->composed);
+	present_frame(srv);
+	pthread_mutex_unlock(&srv->lock);
 
-	close(drm_fd);
-	printf("[BGCE] Display released.\n");
+	for (i = 0; i < n; i++)
+		region_fini(&comp.paint[i]);
+	free(comp.paint);
+	free(comp.stack);
 }
 
 int take_screenshot(const char* filename) {
@@ -590,7 +642,18 @@ int take_screenshot(const char* filename) {
 
 	uint32_t width = server.display_w;
 	uint32_t height = server.display_h;
-	uint32_t stride = width * BGCE_BYTES_PER_PIXEL;
+	uint32_t stride = server.pitch;
+
+	// The compositor thread paints into it, copy a whole frame
+	void* pixels = malloc((size_t)stride * height);
+	if (!pixels) {
+		perror("[BGCE] malloc (screenshot)");
+		return -1;
+	}
+	pthread_mutex_lock(&server.lock);
+	// Never read back from the scanout when a cached copy exists
+	memcpy(pixels, server.shadow ? server.shadow : server.framebuffer, (size_t)stride * height);
+	pthread_mutex_unlock(&server.lock);
 
 	// Write the framebuffer to a PNG file
 	int result = stbi_write_png(
@@ -598,9 +661,10 @@ int take_screenshot(const char* filename) {
 		width,
 		height,
 		BGCE_BYTES_PER_PIXEL,
-		server.framebuffer,
+		pixels,
 		stride
 	);
+	free(pixels);
 
 	if (!result) {
 		fprintf(stderr, "Failed to save screenshot to %s.\n", filename);
@@ -0,0 +1,409 @@
+/*
+ * drm_dumb_cursor.c
+ *
+ * Minimal example showing how to:
+ *  - initialize DRM
+ *  - create dumb buffers (scanout + cursor)
+ *  - use drmModeSetCrtc and drmModeSetCursor
+ *
+ * Build:
+ *   gcc drm_dumb_cursor.c -o drm_dumb_cursor -ldrm
+ *
+ * Run (needs permissions to /dev/dri/cardX):
+ *   sudo ./drm_dumb_cursor
+ *
+ * NOTE: This is example/demo code. Error handling tries to be good, but
+ * real production code should be more thorough and handle more corner cases.
+ */
+
+#include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+static int drm_fd = -1;
+static uint32_t conn_id = 0;
+static uint32_t cur_fb = 0;
+static uint32_t cur_handle;
+static uint64_t cur_size;
+static void* cur_map;
+static drmModeConnector* connector = NULL;
+static drmModeModeInfo mode;
+static drmModeRes* resources = NULL;
+static drmModeEncoder* encoder = NULL;
+static drmModeCrtc* saved_crtc = NULL;
+
+/* wrappers for ioctl structures (from drm_mode.h) */
+static int drm_create_dumb(int fd, uint32_t width, uint32_t height, uint32_t bpp,
+                           struct drm_mode_create_dumb* create) {
+	memset(create, 0, sizeof(*create));
+	create->width = width;
+	create->height = height;
+	create->bpp = bpp;
+	if (ioctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, create) < 0) {
+		perror("DRM_IOCTL_MODE_CREATE_DUMB");
+		return -1;
+	}
+	return 0;
+}
+
+static int drm_map_dumb(int fd, uint32_t handle, uint64_t* offset) {
+	struct drm_mode_map_dumb map = {0};
+	map.handle = handle;
+	if (ioctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+		perror("DRM_IOCTL_MODE_MAP_DUMB");
+		return -1;
+	}
+	*offset = map.offset;
+	return 0;
+}
+
+static int drm_destroy_dumb(int fd, uint32_t handle) {
+	struct drm_mode_destroy_dumb dest = {0};
+	dest.handle = handle;
+	if (ioctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dest) < 0) {
+		perror("DRM_IOCTL_MODE_DESTROY_DUMB");
+		return -1;
+	}
+	return 0;
+}
+
+/* Create, map and register one dumb buffer of the swapchain */
+static int create_scanout(struct ScanoutBuffer* b, uint32_t width, uint32_t height, uint32_t bpp) {
+	struct drm_mode_create_dumb create = {0};
+	if (drm_create_dumb(drm_fd, width, height, bpp, &create) < 0) {
+		fprintf(stderr, "Failed to create dumb buffer for scanout\n");
+		return -1;
+	}
+	b->handle = create.handle;
+	b->size = create.size;
+	b->pitch = create.pitch;
+
+	/* allocate map */
+	uint64_t offset;
+	if (drm_map_dumb(drm_fd, b->handle, &offset) < 0) {
+		fprintf(stderr, "Failed to map dumb buffer for scanout\n");
+		return -1;
+	}
+
+	b->map = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_fd, offset);
+	if (b->map == MAP_FAILED) {
+		perror("mmap scanout");
+		b->map = NULL;
+		return -1;
+	}
+
+	/* Clear/draw content */
+	memset(b->map, 0x00, b->size);
+
+	/* Create framebuffer object for scanout.
+	 * Prefer drmModeAddFB2 (for specifying pixel-format), fallback to drmModeAddFB.
+	 */
+	bool fb2_ok = false;
+#ifdef DRM_FORMAT_ARGB8888
+	/* try adb2 path */
+	{
+		uint32_t handles[4] = {b->handle, 0, 0, 0};
+		uint32_t pitches[4] = {b->pitch, 0, 0, 0};
+		uint32_t offsets[4] = {0, 0, 0, 0};
+		uint32_t format = DRM_FORMAT_XRGB8888; /* scanout content uses XRGB (no alpha) */
+		if (drmModeAddFB2(drm_fd, width, height, format, handles, pitches, offsets, &b->fb_id, 0) == 0) {
+			fb2_ok = true;
+		} else {
+			/* drmModeAddFB2 may fail on older drivers; we'll fallback */
+			fb2_ok = false;
+		}
+	}
+#endif
+
+	if (!fb2_ok) {
+		/* compute depth and bpp for legacy call */
+		uint32_t depth = 24;
+		if (drmModeAddFB(drm_fd, width, height, depth, bpp, b->pitch, b->handle, &b->fb_id) != 0) {
+			fprintf(stderr, "drmModeAddFB failed\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void destroy_scanout(struct ScanoutBuffer* b) {
+	if (b->fb_id)
+		drmModeRmFB(drm_fd, b->fb_id);
+	if (b->map)
+		munmap(b->map, b->size);
+	if (b->handle)
+		drm_destroy_dumb(drm_fd, b->handle);
+}
+
+static int drm_init(struct ServerState* srv, struct config* config) {
+	uint32_t crtc_id = 0;
+	drmModeModeInfo chosen_mode;
+	bool found = false;
+	(void)config;
+
+	const char* dri_card = "/dev/dri/card1";
+	drm_fd = open(dri_card, O_RDWR | O_CLOEXEC);
+	if (drm_fd < 0) {
+		perror("open drm device");
+		return 1;
+	}
+	srv->drm_fd = drm_fd;
+
+	// if (setup_vt_handling() < 0) {
+	//	close(server->drm_fd);
+	//	return -1;
+	// }
+
+	resources = drmModeGetResources(drm_fd);
+	if (!resources) {
+		fprintf(stderr, "drmModeGetResources failed\n");
+		close(drm_fd);
+		return 1;
+	}
+
+	/* Find first connected connector with at least one mode */
+	for (int i = 0; i < resources->count_connectors; i++) {
+		connector = drmModeGetConnector(drm_fd, resources->connectors[i]);
+		if (!connector)
+			continue;
+		if (connector->connection == DRM_MODE_CONNECTED && connector->count_modes > 0) {
+			/* choose first mode */
+			chosen_mode = connector->modes[0];
+			conn_id = connector->connector_id;
+			found = true;
+			break;
+		}
+		drmModeFreeConnector(connector);
+		connector = NULL;
+	}
+
+	if (!found) {
+		fprintf(stderr, "No connected connector with modes found\n");
+		drmModeFreeResources(resources);
+		close(drm_fd);
+		return 1;
+	}
+
+	/* Try to find an encoder and CRTC */
+	if (connector->encoder_id)
+		encoder = drmModeGetEncoder(drm_fd, connector->encoder_id);
+
+	if (encoder && encoder->crtc_id) {
+		crtc_id = encoder->crtc_id;
+	} else {
+		/* fallback: choose any possible CRTC from resources */
+		for (int i = 0; i < resources->count_encoders; i++) {
+			drmModeEncoder* enc = drmModeGetEncoder(drm_fd, resources->encoders[i]);
+			if (!enc)
+				continue;
+			/* pick first crtc that exists */
+			for (int c = 0; c < resources->count_crtcs; c++) {
+				uint32_t possible = enc->possible_crtcs;
+				if (possible & (1 << c)) {
+					crtc_id = resources->crtcs[c];
+					break;
+				}
+			}
+			drmModeFreeEncoder(enc);
+			if (crtc_id)
+				break;
+		}
+	}
+
+	if (!crtc_id) {
+		fprintf(stderr, "Failed to find a suitable CRTC\n");
+		drmModeFreeConnector(connector);
+		drmModeFreeResources(resources);
+		close(drm_fd);
+		return 1;
+	}
+
+	/* Save current CRTC to restore later */
+	saved_crtc = drmModeGetCrtc(drm_fd, crtc_id);
+	if (!saved_crtc) {
+		fprintf(stderr, "drmModeGetCrtc failed\n");
+		/* continue anyway, but we'll try to restore nothing */
+	}
+
+	uint32_t width = chosen_mode.hdisplay;
+	uint32_t height = chosen_mode.vdisplay;
+	uint32_t bpp = 32; /* use 32bpp for scanout */
+	srv->crtc_id = crtc_id;
+	srv->display_w = chosen_mode.hdisplay;
+	srv->display_h = chosen_mode.vdisplay;
+	srv->display_bpp = bpp;
+
+	printf("[BGCE] Setting up connector %u, CRTC %u, mode %ux%u@%u\n",
+	       conn_id, crtc_id, width, height, chosen_mode.vrefresh);
+
+	/* ---------- Create dumb scanout buffers ---------- */
+	srv->refresh = chosen_mode.vrefresh ? chosen_mode.vrefresh : 60;
+	for (int i = 0; i < srv->scanout_count; i++) {
+		if (create_scanout(&srv->scanout[i], width, height, bpp) < 0) {
+			return -1;
+		}
+	}
+	mode = chosen_mode;
+
+	/* ---------- Create dumb cursor buffer (small ARGB) ---------- */
+
+	struct drm_mode_create_dumb cur_create = {0};
+	if (drm_create_dumb(drm_fd, CURSOR_WIDTH, CURSOR_HEIGHT, 32, &cur_create) < 0) {
+		fprintf(stderr, "Failed to create dumb buffer for cursor\n");
+		return -1;
+	}
+	cur_handle = cur_create.handle;
+	cur_size = cur_create.size;
+
+	uint64_t cur_offset;
+	uint32_t cur_pitch = cur_create.pitch;
+	if (drm_map_dumb(drm_fd, cur_handle, &cur_offset) < 0) {
+		fprintf(stderr, "Failed to map dumb cursor\n");
+		return -1;
+	}
+	cur_map = mmap(NULL, cur_size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_fd, cur_offset);
+	if (cur_map == MAP_FAILED) {
+		perror("mmap cursor");
+		return -1;
+	}
+	memset(cur_map, 0, cur_size);
+
+	draw_cursor((uint8_t*)cur_map, cur_pitch, CURSOR_WIDTH, CURSOR_HEIGHT);
+
+#ifdef DRM_FORMAT_ARGB8888
+	{
+		uint32_t handles[4] = {cur_handle, 0, 0, 0};
+		uint32_t pitches[4] = {cur_pitch, 0, 0, 0};
+		uint32_t offsets[4] = {0, 0, 0, 0};
+		uint32_t format = DRM_FORMAT_ARGB8888;
+		if (drmModeAddFB2(drm_fd, cur_w, cur_h, format, handles, pitches, offsets, &cur_fb, 0) != 0) {
+			fprintf(stderr, "drmModeAddFB2 for cursor failed, trying legacy\n");
+			cur_fb = 0;
+		}
+	}
+#endif
+	if (!cur_fb) {
+		/* Legacy fb creation for cursor might not support alpha; still try */
+		uint32_t depth = 24;
+		if (drmModeAddFB(drm_fd, CURSOR_WIDTH, CURSOR_HEIGHT, depth, 32, cur_pitch, cur_handle, &cur_fb) != 0) {
+			fprintf(stderr, "drmModeAddFB for cursor failed\n");
+			return -1;
+		}
+	}
+
+	/* ---------- Set CRTC (scanout) ---------- */
+	if (drmModeSetCrtc(drm_fd, crtc_id, srv->scanout[0].fb_id, 0, 0, &conn_id, 1, &chosen_mode) != 0) {
+		fprintf(stderr, "drmModeSetCrtc failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* ---------- Set cursor ---------- */
+	if (drmModeSetCursor(drm_fd, crtc_id, cur_handle, CURSOR_WIDTH, CURSOR_HEIGHT) != 0) {
+		fprintf(stderr, "drmModeSetCursor failed: %s\n", strerror(errno));
+		/* keep going — maybe hardware doesn't support cursor */
+	} else {
+		/* move cursor to near center */
+		if (drmModeMoveCursor(drm_fd, crtc_id, width / 2, height / 2) != 0) {
+			fprintf(stderr, "drmModeMoveCursor failed\n");
+		}
+	}
+
+	return 0;
+}
+
+static void drm_release(struct ServerState* srv) {
+	if (cur_fb)
+		drmModeRmFB(drm_fd, cur_fb);
+
+	if (cur_map && cur_map != MAP_FAILED)
+		munmap(cur_map, cur_size);
+
+	if (cur_handle)
+		drm_destroy_dumb(drm_fd, cur_handle);
+
+	for (int i = 0; i < srv->scanout_count; i++)
+		destroy_scanout(&srv->scanout[i]);
+
+	/* restore saved CRTC if we have it */
+	if (saved_crtc) {
+		drmModeSetCrtc(drm_fd, saved_crtc->crtc_id,
+		               saved_crtc->buffer_id,
+		               saved_crtc->x, saved_crtc->y,
+		               &conn_id, 1,
+		               &saved_crtc->mode);
+		drmModeFreeCrtc(saved_crtc);
+	}
+
+	if (connector)
+		drmModeFreeConnector(connector);
+	if (resources)
+		drmModeFreeResources(resources);
+	if (encoder)
+		drmModeFreeEncoder(encoder);
+
+	if (drm_fd >= 0)
+		close(drm_fd);
+	drm_fd = -1;
+	srv->drm_fd = -1;
+}
+
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+                              unsigned int tv_usec, void* data) {
+	(void)fd;
+	(void)sequence;
+	/* Kernels stamp vblanks with CLOCK_MONOTONIC */
+	struct timespec when = {.tv_sec = tv_sec, .tv_nsec = tv_usec * 1000L};
+	display_flip_done(data, &when);
+}
+
+/* Fall back to a plain mode set when flipping fails, tearing beats a frozen screen */
+static int drm_flip(struct ServerState* srv, int buffer) {
+	struct ScanoutBuffer* b = &srv->scanout[buffer];
+	if (drmModePageFlip(drm_fd, srv->crtc_id, b->fb_id, DRM_MODE_PAGE_FLIP_EVENT, srv) == 0) {
+		return 0;
+	}
+
+	perror("[BGCE] drmModePageFlip");
+	drmModeSetCrtc(drm_fd, srv->crtc_id, b->fb_id, 0, 0, &conn_id, 1, &mode);
+	return 1;
+}
+
+static void drm_move_cursor(struct ServerState* srv, int x, int y) {
+	drmModeMoveCursor(drm_fd, srv->crtc_id, x, y);
+}
+
+static int drm_event_fd(struct ServerState* srv) {
+	/* Only flips generate events */
+	return srv->scanout_count > 1 ? drm_fd : -1;
+}
+
+static void drm_dispatch(struct ServerState* srv) {
+	(void)srv;
+	drmEventContext ctx = {
+	        .version = DRM_EVENT_CONTEXT_VERSION,
+	        .page_flip_handler = page_flip_handler,
+	};
+	drmHandleEvent(drm_fd, &ctx);
+}
+
+const struct OutputBackend drm_backend = {
+        .name = "drm",
+        .init = drm_init,
+        .release = drm_release,
+        .flip = drm_flip,
+        .move_cursor = drm_move_cursor,
+        .event_fd = drm_event_fd,
+        .dispatch = drm_dispatch,
+};
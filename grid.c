@@ -0,0 +1,132 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Hit testing: the screen is divided into square cells, each listing
+ * the windows over it, so finding the window under the pointer only
+ * looks at the few windows of one cell, however many there are. A
+ * window is listed in the cells its rectangle touches; the lists are
+ * updated whenever it moves or changes size, and stacking order comes
+ * from z, so raising a window changes nothing here.
+ *
+ * Only the event loop thread uses the grid.
+ */
+
+#define GRID_CELL 128 /* pixels */
+
+struct GridCell {
+	struct Client** clients;
+	uint32_t count;
+	uint32_t cap;
+};
+
+static struct GridCell* cells;
+static int32_t cols;
+static int32_t rows;
+
+int init_grid(uint32_t width, uint32_t height) {
+	/* Pointers reach the right and bottom edges, inclusive */
+	cols = width / GRID_CELL + 1;
+	rows = height / GRID_CELL + 1;
+	cells = calloc((size_t)cols * rows, sizeof(struct GridCell));
+	if (!cells) {
+		perror("[BGCE] calloc (grid)");
+		return -1;
+	}
+	return 0;
+}
+
+static int32_t clamp(int32_t v, int32_t max) {
+	return v < 0 ? 0 : v > max ? max : v;
+}
+
+static void cell_remove(struct GridCell* cell, const struct Client* c) {
+	for (uint32_t i = 0; i < cell->count; i++) {
+		if (cell->clients[i] == c) {
+			cell->clients[i] = cell->clients[--cell->count];
+			return;
+		}
+	}
+}
+
+static int cell_add(struct GridCell* cell, struct Client* c) {
+	if (cell->count == cell->cap) {
+		uint32_t cap = cell->cap ? cell->cap * 2 : 4;
+		struct Client** clients = realloc(cell->clients, cap * sizeof(*clients));
+		if (!clients) {
+			perror("[BGCE] realloc (grid)");
+			return -1;
+		}
+		cell->clients = clients;
+		cell->cap = cap;
+	}
+	cell->clients[cell->count++] = c;
+	return 0;
+}
+
+void grid_remove(struct Client* c) {
+	if (!c->gridded)
+		return;
+	for (int32_t y = c->grid.y1; y <= c->grid.y2; y++) {
+		for (int32_t x = c->grid.x1; x <= c->grid.x2; x++)
+			cell_remove(&cells[y * cols + x], c);
+	}
+	c->gridded = 0;
+}
+
+void grid_update(struct Client* c) {
+	if (!cells)
+		return;
+
+	/* Same bounds as pick_client() tests, right and bottom edges included */
+	struct Rect span = {
+	        .x1 = clamp(c->x / GRID_CELL, cols - 1),
+	        .y1 = clamp(c->y / GRID_CELL, rows - 1),
+	        .x2 = clamp((c->x + (int32_t)c->width) / GRID_CELL, cols - 1),
+	        .y2 = clamp((c->y + (int32_t)c->height) / GRID_CELL, rows - 1),
+	};
+	int offscreen = c->x + (int32_t)c->width < 0 || c->y + (int32_t)c->height < 0 ||
+	                c->x / GRID_CELL >= cols || c->y / GRID_CELL >= rows;
+	int show = c->buffer && !offscreen;
+
+	if (c->gridded && show && span.x1 == c->grid.x1 && span.y1 == c->grid.y1 &&
+	    span.x2 == c->grid.x2 && span.y2 == c->grid.y2)
+		return;
+
+	grid_remove(c);
+	if (!show)
+		return;
+
+	for (int32_t y = span.y1; y <= span.y2; y++) {
+		for (int32_t x = span.x1; x <= span.x2; x++) {
+			if (cell_add(&cells[y * cols + x], c) < 0) {
+				/* Keep what was added, so grid_remove() finds it */
+				span.y2 = y;
+				c->grid = span;
+				c->gridded = 1;
+				grid_remove(c);
+				return;
+			}
+		}
+	}
+	c->grid = span;
+	c->gridded = 1;
+}
+
+struct Client* pick_client(int x, int y) {
+	if (!cells || x < 0 || y < 0)
+		return NULL;
+
+	const struct GridCell* cell = &cells[clamp(y / GRID_CELL, rows - 1) * cols + clamp(x / GRID_CELL, cols - 1)];
+	struct Client* picked = NULL;
+	for (uint32_t i = 0; i < cell->count; i++) {
+		struct Client* c = cell->clients[i];
+		if (x >= c->x && x <= (c->x + (int32_t)c->width) &&
+		    y >= c->y && y <= (c->y + (int32_t)c->height) &&
+		    (!picked || c->z > picked->z))
+			picked = c;
+	}
+	return picked && picked->z > 0 ? picked : NULL; // avoid getting the background
+}
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Headless output: the scanout buffers are memfd backed memory and a
+ * timer ticking at the configured refresh rate stands in for the
+ * vertical blank, flips complete on the next tick. The cursor is an
+ * image and a position nobody scans out.
+ *
+ * This runs the whole server without a display, which is what makes
+ * compositing throughput and latency measurable on any machine.
+ */
+
+static int vblank_fd = -1;
+static uint32_t cursor_image[CURSOR_WIDTH * CURSOR_HEIGHT];
+static int cursor_x;
+static int cursor_y;
+
+static int headless_init(struct ServerState* srv, struct config* config) {
+	srv->display_w = config->width;
+	srv->display_h = config->height;
+	srv->display_bpp = 32;
+	srv->refresh = config->refresh ? config->refresh : 60;
+
+	printf("[BGCE] Headless mode %ux%u@%u\n", srv->display_w, srv->display_h, srv->refresh);
+
+	for (int i = 0; i < srv->scanout_count; i++) {
+		struct ScanoutBuffer* b = &srv->scanout[i];
+		b->pitch = ALIGN_STRIDE(srv->display_w);
+		b->size = (uint64_t)b->pitch * srv->display_h;
+
+		int fd = memfd_create("bgce-scanout", MFD_CLOEXEC);
+		if (fd < 0) {
+			perror("[BGCE] memfd_create");
+			return -1;
+		}
+		if (ftruncate(fd, b->size) < 0) {
+			perror("[BGCE] ftruncate scanout");
+			close(fd);
+			return -1;
+		}
+		b->map = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (b->map == MAP_FAILED) {
+			perror("[BGCE] mmap scanout");
+			b->map = NULL;
+			return -1;
+		}
+	}
+
+	draw_cursor((uint8_t*)cursor_image, CURSOR_WIDTH * 4, CURSOR_WIDTH, CURSOR_HEIGHT);
+	cursor_x = srv->display_w / 2;
+	cursor_y = srv->display_h / 2;
+
+	vblank_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (vblank_fd < 0) {
+		perror("[BGCE] timerfd_create");
+		return -1;
+	}
+
+	long interval = 1000000000L / srv->refresh;
+	struct itimerspec its = {
+	        .it_interval = {.tv_sec = 0, .tv_nsec = interval},
+	        .it_value = {.tv_sec = 0, .tv_nsec = interval},
+	};
+	if (timerfd_settime(vblank_fd, 0, &its, NULL) < 0) {
+		perror("[BGCE] timerfd_settime");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void headless_release(struct ServerState* srv) {
+	for (int i = 0; i < srv->scanout_count; i++) {
+		struct ScanoutBuffer* b = &srv->scanout[i];
+		if (b->map)
+			munmap(b->map, b->size);
+	}
+
+	if (vblank_fd >= 0)
+		close(vblank_fd);
+	vblank_fd = -1;
+}
+
+static int headless_flip(struct ServerState* srv, int buffer) {
+	(void)srv;
+	(void)buffer;
+	return 0; /* completes on the next tick */
+}
+
+static void headless_move_cursor(struct ServerState* srv, int x, int y) {
+	(void)srv;
+	cursor_x = x;
+	cursor_y = y;
+}
+
+static int headless_event_fd(struct ServerState* srv) {
+	(void)srv;
+	return vblank_fd;
+}
+
+static void headless_dispatch(struct ServerState* srv) {
+	uint64_t ticks;
+	if (read(vblank_fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return;
+	display_flip_done(srv, NULL);
+}
+
+const struct OutputBackend headless_backend = {
+        .name = "headless",
+        .init = headless_init,
+        .release = headless_release,
+        .flip = headless_flip,
+        .move_cursor = headless_move_cursor,
+        .event_fd = headless_event_fd,
+        .dispatch = headless_dispatch,
+};
@@ -6,12 +6,15 @@
 #include <fcntl.h>
 #include <linux/input.h>
 #include <linux/kd.h>
-#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #define test_bit(bit, array) ((array)[(bit) / 8] & (1 << ((bit) % 8)))
@@ -22,147 +25,434 @@ int alt_down = 0;
 int mouse_x;
 int mouse_y;
 
-size_t count;
-struct pollfd fds[MAX_INPUT_DEVICES];
+/*
+ * Devices are read in batches of up to INPUT_READ_MAX events and
+ * handled a frame at a time, the events a device reports together,
+ * up to its SYN_REPORT.
+ */
+#define INPUT_READ_MAX 64
+#define INPUT_FRAME_MAX 64
+
+struct InputFrame {
+	struct input_event evs[INPUT_FRAME_MAX];
+	size_t count;
+	int dropped; /* SYN_DROPPED seen, skip to the next report */
+};
+
+/*
+ * Devices come and go: /dev/input is watched with inotify, nodes are
+ * opened when they appear or their permissions change and closed when
+ * they go away. What probing found is kept per node, so the many
+ * attribute changes udev makes cost a stat() each. Removed devices are
+ * kept for reuse, an event of the same epoll round may still point at
+ * their watch.
+ */
+struct InputDev {
+	struct Watch watch;
+	struct InputFrame frame;
+	struct InputDevice info;
+	char node[32]; /* name in INPUT_DIR */
+	int monotonic; /* event times are CLOCK_MONOTONIC, else read times are used */
+	struct InputDev* next; /* in spare_devices */
+};
+
+/* What a node turned out to be, valid while it keeps its ctime */
+struct Probe {
+	dev_t rdev;
+	struct timespec ctime;
+	int usable;
+	uint16_t type_mask;
+	char name[256];
+};
+
+static struct InputDev** devices;
+static size_t count;
+static size_t devices_cap;
+static struct InputDev* spare_devices;
+static uint16_t next_device_id;
+
+static struct Probe* probes;
+static size_t probe_count;
+static size_t probes_cap;
+
+static struct Watch hotplug_watch = {.fd = -1};
+
+static void input_ready(struct Watch* w, uint32_t events);
 
 struct {
 	int active;
 	struct Client* target;
-	int dx;
+	int dx; /* resize so far, or motion not applied to the move yet */
 	int dy;
+	uint64_t input_ns; /* time of the oldest motion not applied yet */
 	enum {
 		DRAG_MOVE,
 		DRAG_RESIZE
 	} type;
 } drag;
 
+/*
+ * Moving a window repaints both areas, so drags follow the pointer at
+ * most once per refresh: motion in between piles up in drag.dx and
+ * drag.dy and a timer applies it at the next refresh.
+ */
+static struct Watch drag_timer = {.fd = -1};
+static struct timespec drag_next; /* CLOCK_MONOTONIC */
+static int drag_armed;
+
 extern struct ServerState server;
 
+/* Reallocate the buffers of c, returns the fd of the new ones or -1 */
 int resize_buffer(struct Client* c, int dx, int dy) {
-	// for resize we must reallocate the buffer
-	// Unmap and unlink old buffer
-	if (c->buffer) {
-		munmap(c->buffer, c->width * c->height * BGCE_BYTES_PER_PIXEL);
-		shm_unlink(c->shm_name);
+	int fd = allocate_buffers(c, c->width + dx, c->height + dy, c->buffer_count, c->flags);
+	if (fd < 0) {
+		return -1;
 	}
+	printf("[BGCE] Client resized: %p size=%zu (%dx%d) fd=%d\n",
+	       c->buffer,
+	       c->map_size,
+	       c->width, c->height,
+	       c->fd);
+	return fd;
+}
 
-	// Create new shared memory name and object
-	snprintf(c->shm_name, sizeof(c->shm_name),
-	         "bgce_buf_%d_%ld", getpid(), time(NULL));
-	int shm_fd = shm_open(c->shm_name, O_CREAT | O_RDWR, 0600);
-	if (shm_fd < 0) {
-		perror("shm_open for resize");
-		return 0;
+/* Move the dragged window by the motion piled up */
+static void apply_drag(void) {
+	struct Client* c = drag.target;
+	if (!drag.active || drag.type != DRAG_MOVE || !c || (!drag.dx && !drag.dy))
+		return;
+
+	// Both the old and the new area need repainting
+	move_client(&server, c, c->x + drag.dx, c->y + drag.dy);
+	pthread_mutex_lock(&server.lock);
+	latency_damage_locked(drag.input_ns);
+	pthread_mutex_unlock(&server.lock);
+	schedule_frame(&server);
+	drag.dx = 0;
+	drag.dy = 0;
+	drag.input_ns = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &drag_next);
+	drag_next.tv_nsec += 1000000000L / (server.refresh ? server.refresh : 60);
+	if (drag_next.tv_nsec >= 1000000000L) {
+		drag_next.tv_sec++;
+		drag_next.tv_nsec -= 1000000000L;
 	}
+}
 
-	size_t buf_size = (c->width + dx) * (c->height + dy) * BGCE_BYTES_PER_PIXEL;
-	if (ftruncate(shm_fd, buf_size) < 0) {
-		perror("ftruncate for resize");
-		close(shm_fd);
-		return 0;
+/* Apply the drag now if a refresh went by since the last time, else later */
+static void queue_drag(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int due = now.tv_sec > drag_next.tv_sec ||
+	          (now.tv_sec == drag_next.tv_sec && now.tv_nsec >= drag_next.tv_nsec);
+	if (due || drag_timer.fd < 0) {
+		apply_drag();
+		return;
 	}
-
-	c->buffer = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-	if (c->buffer == MAP_FAILED) {
-		perror("mmap for resize");
-		close(shm_fd);
-		return 0;
+	if (drag_armed)
+		return;
+
+	struct itimerspec when = {.it_value = drag_next};
+	if (timerfd_settime(drag_timer.fd, TFD_TIMER_ABSTIME, &when, NULL) < 0) {
+		perror("[BGCE] timerfd_settime");
+		apply_drag();
+		return;
 	}
+	drag_armed = 1;
+}
 
-	c->width += dx;
-	c->height += dy;
-	close(shm_fd);
-	printf("[BGCE] Client resized: %p size=%zu (%dx%d) name=%s\n",
-	       c->buffer,
-	       c->width * c->height * 4UL,
-	       c->width, c->height,
-	       c->shm_name);
-	return 1;
+static void drag_timer_ready(struct Watch* w, uint32_t events) {
+	(void)events;
+	uint64_t expired;
+	if (read(w->fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+		perror("[BGCE] read timerfd");
+	drag_armed = 0;
+	apply_drag();
 }
 
-struct Client* pick_client(int x, int y) {
-	// Iterate through clients to find the topmost client under the cursor
-	struct Client* c = server.clients;
-	struct Client* picked = NULL;
-	while (c) {
-		if (x >= c->x && x <= (c->x + c->width) &&
-		    y >= c->y && y <= (c->y + c->height)) {
-			picked = c;
-			break;
-		}
-		c = c->next;
+/* The client is going away, stop dragging it */
+void forget_input_client(struct Client* c) {
+	if (drag.target == c) {
+		drag.active = 0;
+		drag.target = NULL;
 	}
-	return picked->z > 0 ? picked : NULL; // avoid getting the background
 }
 
-int init_input(void) {
-	count = 0;
-	drag.active = 0;
-	mouse_x = server.display_w / 2;
-	mouse_y = server.display_h / 2;
+static struct InputDev* find_device(const char* node) {
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(devices[i]->node, node) == 0)
+			return devices[i];
+	}
+	return NULL;
+}
 
-	DIR* dir = opendir(INPUT_DIR);
-	if (!dir) {
-		perror("[BGCE] Failed to open /dev/input");
-		return -1;
+static struct Probe* find_probe(dev_t rdev) {
+	for (size_t i = 0; i < probe_count; i++) {
+		if (probes[i].rdev == rdev)
+			return &probes[i];
 	}
+	return NULL;
+}
 
-	struct dirent* ent;
-	while ((ent = readdir(dir)) != NULL && count < MAX_INPUT_DEVICES) {
-		if (strncmp(ent->d_name, "event", 5) != 0)
-			continue;
+/* Ask the device what it is, fd open, into p */
+static void probe(int fd, struct Probe* p) {
+	uint8_t ev_bits[(EV_MAX + 7) / 8] = {0};
+	p->usable = 0;
+	if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0)
+		return;
+
+	// Filter for useful input types
+	p->type_mask = 0;
+	for (int type = 0; type < 16; type++) {
+		if (test_bit(type, ev_bits))
+			p->type_mask |= 1 << type;
+	}
+	p->usable = test_bit(EV_KEY, ev_bits) || test_bit(EV_REL, ev_bits);
 
-		char path[256 + 12];
-		snprintf(path, sizeof(path), "%s/%s", INPUT_DIR, ent->d_name);
+	// Try to get device name
+	if (ioctl(fd, EVIOCGNAME(sizeof(p->name)), p->name) < 0)
+		strcpy(p->name, "Unknown");
+	p->name[sizeof(p->name) - 1] = '\0';
+}
 
-		int fd = open(path, O_RDONLY);
-		if (fd < 0)
-			continue; // skip inaccessible devices
+/* A node appeared or changed, open it if it is a device worth reading */
+static void add_device(const char* node) {
+	if (strncmp(node, "event", 5) != 0 || strlen(node) >= sizeof(((struct InputDev*)0)->node))
+		return;
+	if (find_device(node))
+		return;
+
+	char path[sizeof(INPUT_DIR) + 32];
+	snprintf(path, sizeof(path), "%s/%s", INPUT_DIR, node);
+	struct stat st;
+	if (stat(path, &st) < 0 || !S_ISCHR(st.st_mode))
+		return;
+
+	struct Probe* p = find_probe(st.st_rdev);
+	int fresh = p && p->ctime.tv_sec == st.st_ctim.tv_sec && p->ctime.tv_nsec == st.st_ctim.tv_nsec;
+	if (fresh && !p->usable)
+		return; // known to be of no use, or inaccessible
+	if (!p) {
+		if (probe_count == probes_cap) {
+			size_t cap = probes_cap ? probes_cap * 2 : 8;
+			struct Probe* grown = realloc(probes, cap * sizeof(*grown));
+			if (!grown) {
+				perror("[BGCE] realloc (probes)");
+				return;
+			}
+			probes = grown;
+			probes_cap = cap;
+		}
+		p = &probes[probe_count++];
+		p->rdev = st.st_rdev;
+	}
+	p->ctime = st.st_ctim;
 
-		unsigned long ev_bits[(EV_MAX + 7) / 8] = {0};
-		if (ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0) {
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		p->usable = 0; // skip inaccessible devices until their permissions change
+		return;
+	}
+	if (!fresh)
+		probe(fd, p);
+	if (!p->usable) {
+		close(fd);
+		return;
+	}
+	if (count == devices_cap) {
+		size_t cap = devices_cap ? devices_cap * 2 : 8;
+		struct InputDev** grown = realloc(devices, cap * sizeof(*grown));
+		if (!grown) {
+			perror("[BGCE] realloc (input devices)");
 			close(fd);
-			continue;
+			return;
 		}
+		devices = grown;
+		devices_cap = cap;
+	}
 
-		// Filter for useful input types
-		int has_key = test_bit(EV_KEY, ev_bits);
-		int has_rel = test_bit(EV_REL, ev_bits);
-		if (!has_key && !has_rel) {
-			close(fd);
-			continue;
+	struct InputDev* dev = spare_devices;
+	if (dev)
+		spare_devices = dev->next;
+	else if (!(dev = malloc(sizeof(struct InputDev)))) {
+		perror("[BGCE] malloc (input device)");
+		close(fd);
+		return;
+	}
+	memset(dev, 0, sizeof(*dev));
+	/* Timestamps comparable with the rest of the server, for latency */
+	int clock = CLOCK_MONOTONIC;
+	dev->monotonic = ioctl(fd, EVIOCSCLOCKID, &clock) == 0;
+	dev->watch.fd = fd;
+	dev->watch.ready = input_ready;
+	dev->watch.data = dev;
+	if (watch_fd(&dev->watch, EPOLLIN) < 0) {
+		close(fd);
+		dev->next = spare_devices;
+		spare_devices = dev;
+		return;
+	}
+	strcpy(dev->node, node);
+	dev->info.id = next_device_id++;
+	dev->info.type_mask = p->type_mask;
+	strcpy(dev->info.name, p->name);
+	devices[count++] = dev;
+
+	printf("[BGCE] Input device accepted: %s (%s)%s%s\n",
+	       path, p->name,
+	       p->type_mask & (1 << EV_KEY) ? " [KEY]" : "",
+	       p->type_mask & (1 << EV_REL) ? " [REL]" : "");
+}
+
+static void remove_device(struct InputDev* dev) {
+	printf("[BGCE] Input device removed: %s (%s)\n", dev->node, dev->info.name);
+	int fd = dev->watch.fd;
+	unwatch_fd(&dev->watch);
+	close(fd);
+
+	for (size_t i = 0; i < count; i++) {
+		if (devices[i] == dev) {
+			memmove(devices + i, devices + i + 1, (count - i - 1) * sizeof(*devices));
+			count--;
+			break;
 		}
+	}
+	dev->next = spare_devices;
+	spare_devices = dev;
+}
+
+static void hotplug_ready(struct Watch* w, uint32_t events) {
+	(void)events;
+	union {
+		struct inotify_event align;
+		char buf[4096];
+	} u;
 
-		// Try to get device name
-		char name[256] = "Unknown";
-		if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) < 0)
-			strcpy(name, "Unknown");
+	while (1) {
+		ssize_t n = read(w->fd, u.buf, sizeof(u.buf));
+		if (n <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EINTR)
+				perror("[BGCE] read inotify");
+			return;
+		}
 
-		fds[count].fd = fd;
-		fds[count].events = POLLIN;
+		for (char* p = u.buf; p < u.buf + n;) {
+			struct inotify_event* ev = (struct inotify_event*)p;
+			p += sizeof(*ev) + ev->len;
+			if (!ev->len)
+				continue;
 
-		server.input.devs[count].id = count;
-		strcpy(server.input.devs[count].name, name);
+			if (ev->mask & IN_DELETE) {
+				struct InputDev* dev = find_device(ev->name);
+				if (dev)
+					remove_device(dev);
+			} else {
+				add_device(ev->name);
+			}
+		}
+	}
+}
 
-		count++;
+size_t list_input_devices(struct InputDevice* out, size_t max) {
+	static size_t warned; /* device count last warned about */
 
-		printf("[BGCE] Input device accepted: %s (%s)%s%s\n",
-		       path, name,
-		       has_key ? " [KEY]" : "",
-		       has_rel ? " [REL]" : "");
+	size_t n = count < max ? count : max;
+	if (count > max && count != warned)
+		fprintf(stderr, "[BGCE] Listing only %zu of %zu input devices\n", max, count);
+	warned = count > max ? count : 0;
+	for (size_t i = 0; i < n; i++)
+		out[i] = devices[i]->info;
+	return n;
+}
+
+int init_input(void) {
+	drag.active = 0;
+
+	drag_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	drag_timer.ready = drag_timer_ready;
+	if (drag_timer.fd < 0 || watch_fd(&drag_timer, EPOLLIN) < 0) {
+		perror("[BGCE] drag timer"); /* drags then move on every report */
+		if (drag_timer.fd >= 0)
+			close(drag_timer.fd);
+		drag_timer.fd = -1;
+	}
+	mouse_x = server.display_w / 2;
+	mouse_y = server.display_h / 2;
+
+	/* Watch before scanning, so no device slips in between */
+	hotplug_watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	hotplug_watch.ready = hotplug_ready;
+	if (hotplug_watch.fd < 0 ||
+	    inotify_add_watch(hotplug_watch.fd, INPUT_DIR, IN_CREATE | IN_ATTRIB | IN_DELETE | IN_MOVED_TO) < 0 ||
+	    watch_fd(&hotplug_watch, EPOLLIN) < 0) {
+		perror("[BGCE] Failed to watch /dev/input");
+		if (hotplug_watch.fd >= 0)
+			close(hotplug_watch.fd);
+		hotplug_watch.fd = -1;
 	}
 
+	DIR* dir = opendir(INPUT_DIR);
+	if (!dir) {
+		perror("[BGCE] Failed to open /dev/input");
+		return -1;
+	}
+
+	struct dirent* ent;
+	while ((ent = readdir(dir)) != NULL)
+		add_device(ent->d_name);
+
 	closedir(dir);
 
 	if (count == 0) {
 		fprintf(stderr, "[BGCE] No suitable input devices found\n");
-		return -1;
+		/* They may be plugged later */
+		return hotplug_watch.fd >= 0 ? 0 : -1;
 	}
-	server.input.count = count;
 
 	return 0;
 }
 
+/*
+ * Pointer motion of a whole frame, applied at once so a diagonal move
+ * moves the cursor once. Returns if it was handled, by a drag.
+ */
+static int handle_motion(int dx, int dy, uint64_t time_ns) {
+	mouse_x += dx;
+	mouse_y += dy;
+
+	// Clamp mouse coordinates to screen boundaries
+	if (mouse_x < 0)
+		mouse_x = 0;
+	if (mouse_y < 0)
+		mouse_y = 0;
+	if (mouse_x > server.display_w)
+		mouse_x = server.display_w;
+	if (mouse_y > server.display_h)
+		mouse_y = server.display_h;
+
+	if (dx || dy) {
+		move_cursor(&server, mouse_x, mouse_y);
+		record_latency(BGCE_LATENCY_CURSOR, time_ns);
+	}
+
+	if (!drag.active)
+		return 0;
+	if (!drag.target) {
+		printf("[BGCE] No client to drag\n");
+		return 1; // Should not happen
+	}
+
+	// Accumulate the move or the new width and height
+	drag.dx += dx;
+	drag.dy += dy;
+	if (!drag.input_ns)
+		drag.input_ns = time_ns;
+	if (drag.type == DRAG_MOVE)
+		queue_drag();
+	return 1;
+}
+
 /*
  * This is the key mappings handling part, for now this is hardcoded
  * but in the future will be read from config.
@@ -212,31 +502,26 @@ static int handle_input_event(struct input_event ev) {
 		if ((ev.code == BTN_LEFT || ev.code == BTN_RIGHT) && drag.active) { // Only stop if it was an active drag of that type
 			printf("[BGCE] End of drag event.\n");
 			if (drag.type == DRAG_MOVE) {
+				apply_drag(); /* where the pointer left it */
 				drag.active = 0;
 				drag.target = NULL;
 				return 1;
 			}
 
 			struct Client* c = drag.target;
-			if (resize_buffer(c, drag.dx, drag.dy)) {
+			int fd = resize_buffer(c, drag.dx, drag.dy);
+			if (fd >= 0) {
 				printf("[BGCE] Redrawing dx=%d dy=%d.\n", drag.dx, drag.dy);
-				if (drag.dx < 0 || drag.dy < 0) {
-					redraw_from_resize(
-					        &server,
-					        *c,
-					        drag.dx,
-					        drag.dy);
-				}
-				draw(&server, *c);
-
-				struct BGCEMessage msg;
-				msg.type = MSG_BUFFER_CHANGE;
+				schedule_frame(&server);
+
+				// The client maps the new buffer from the fd
 				struct BufferReply reply = {0};
-				strncpy(reply.shm_name, c->shm_name, sizeof(reply.shm_name));
 				reply.width = c->width;
 				reply.height = c->height;
-				msg.data.buffer_reply = reply;
-				bgce_send_msg(c->fd, &msg);
+				reply.stride = c->stride;
+				reply.buffers = c->buffer_count;
+				client_send(c, MSG_BUFFER_CHANGE, 0, &reply, sizeof(reply), &fd, 1);
+				close(fd);
 			}
 			drag.active = 0;
 			drag.target = NULL;
@@ -254,9 +539,10 @@ static int handle_input_event(struct input_event ev) {
 			server.focused_client = NULL;
 			return 0;
 		}
-		printf("[BGCE] Click detected at client %s z=%d.\n", c->shm_name, c->z);
+		printf("[BGCE] Click detected at client fd=%d z=%d.\n", c->fd, c->z);
 
 		// If the clicked client is not already the first, move it
+		pthread_mutex_lock(&server.lock);
 		if (c != server.clients) {
 			struct Client* prev = server.clients;
 			while (prev && prev->next != c) {
@@ -264,14 +550,16 @@ static int handle_input_event(struct input_event ev) {
 			}
 			if (prev) {
 				prev->next = c->next;
+				c->z = server.clients->z + 1; // picked over the others
 				c->next = server.clients;
 				server.clients = c;
 			}
 		}
+		pthread_mutex_unlock(&server.lock);
+		update_visibility(&server);
 		if (c != server.focused_client) {
-			c->z = server.focused_client->z + 1;
 			server.focused_client = c;
-			draw(&server, *c);
+			draw(&server, c);
 			printf("[BGCE] Client focused.\n");
 		}
 
@@ -284,6 +572,7 @@ static int handle_input_event(struct input_event ev) {
 		drag.target = c;
 		drag.dx = 0;
 		drag.dy = 0;
+		drag.input_ns = 0;
 
 		if (ev.code == BTN_RIGHT) {
 			drag.type = DRAG_RESIZE;
@@ -296,139 +585,148 @@ static int handle_input_event(struct input_event ev) {
 		return 1;
 	}
 
-	if (ev.type == EV_REL) {
-		int dx = 0;
-		int dy = 0;
-		switch (ev.code) {
-		case REL_X:
-			dx += ev.value;
+	// This means nothing was handled
+	return 0;
+}
+
+/* Send an event handle_input_event() left alone to the focused client */
+static void send_event(const struct InputDev* dev, const struct input_event* ev, uint64_t time_ns) {
+	struct Client* c = server.focused_client;
+	if (!c) {
+		return;
+	}
+
+	struct InputEvent e = {0};
+	e.device = dev->info.id;
+	e.type = ev->type;
+	e.code = ev->code;
+	e.value = ev->value;
+	e.time_ns = time_ns;
+
+	switch (ev->type) {
+	case EV_KEY:
+		if (ev->code != BTN_LEFT && ev->code != BTN_RIGHT) {
 			break;
-		case REL_Y:
-			dy += ev.value;
 		}
-		mouse_x += dx;
-		mouse_y += dy;
-
-		// Clamp mouse coordinates to screen boundaries
-		if (mouse_x < 0)
-			mouse_x = 0;
-		if (mouse_y < 0)
-			mouse_y = 0;
-		if (mouse_x > server.display_w)
-			mouse_x = server.display_w;
-		if (mouse_y > server.display_h)
-			mouse_y = server.display_h;
-
-		drmModeMoveCursor(
-		        server.drm_fd,
-		        server.crtc_id,
-		        mouse_x,
-		        mouse_y);
-
-		if (drag.active) {
-			struct Client* c = drag.target;
-			if (!c) {
-				printf("[BGCE] No client to drag\n");
-				return 1; // Should not happen
-			}
+	case EV_REL: {
+		int in = mouse_x >= c->x && mouse_x <= c->x + c->width &&
+		         mouse_y >= c->y && mouse_y <= c->y + c->height;
+		if (!in) {
+			return;
+		}
 
-			switch (drag.type) {
-			case DRAG_MOVE:
-				// if moving, redraw old region.
-				if (drag.type == DRAG_MOVE) {
-					redraw_region(&server, *c, dx, dy);
-				}
-
-				// Update client's position
-				c->x = c->x + dx;
-				c->y = c->y + dy;
-				draw(&server, *c);
-				break;
-
-			case DRAG_RESIZE:
-				// Accumulate new width and height
-				drag.dx += dx;
-				drag.dy += dy;
-			}
-			return 1;
+		e.x = mouse_x - c->x;
+		e.y = mouse_y - c->y;
+		break;
+	}
+	default:
+		return;
+	}
+
+	/* Send to focused client */
+	struct BGCEMessage msg = {.type = MSG_INPUT_EVENT};
+	msg.data.input_event = e;
+	if (client_send_msg(c, &msg) < 0)
+		return;
+
+	/* Its next commit answers the oldest input */
+	if (!c->input_ns)
+		c->input_ns = time_ns;
+	record_latency(BGCE_LATENCY_DELIVER, time_ns);
+}
+
+/*
+ * One frame of a device, the events up to its SYN_REPORT: the server
+ * acts on all of them first, so clients get them with the state after
+ * the whole frame, like the pointer position.
+ */
+static void handle_input_frame(const struct InputDev* dev, const struct input_event* evs, size_t n,
+                               uint64_t time_ns) {
+	const struct input_event* unhandled[INPUT_FRAME_MAX];
+	size_t count = 0;
+	record_latency(BGCE_LATENCY_DISPATCH, time_ns);
+
+	/* Relative axes add up, clicks then land where the frame moved to */
+	int rel[REL_CNT] = {0};
+	unsigned moved = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (evs[i].type == EV_REL && evs[i].code < REL_CNT) {
+			rel[evs[i].code] += evs[i].value;
+			moved |= 1u << evs[i].code;
 		}
 	}
+	int dragged = moved && handle_motion(rel[REL_X], rel[REL_Y], time_ns);
 
-	// This means nothing was handled
-	return 0;
+	for (size_t i = 0; i < n; i++) {
+		if (evs[i].type == EV_REL)
+			continue;
+		if (!handle_input_event(evs[i]))
+			unhandled[count++] = &evs[i];
+	}
+
+	/* One event per axis that moved */
+	for (int code = 0; code < REL_CNT && !dragged; code++) {
+		if (!(moved & (1u << code)))
+			continue;
+		struct input_event ev = {.type = EV_REL, .code = code, .value = rel[code]};
+		send_event(dev, &ev, time_ns);
+	}
+	for (size_t i = 0; i < count; i++)
+		send_event(dev, unhandled[i], time_ns);
 }
 
-void* input_loop(void* arg) {
-	(void)arg;
+/* When the device saw ev, or now if its clock is not ours */
+static uint64_t event_time(const struct InputDev* dev, const struct input_event* ev) {
+	if (!dev->monotonic)
+		return monotonic_ns();
+	return (uint64_t)ev->input_event_sec * 1000000000ULL + (uint64_t)ev->input_event_usec * 1000;
+}
 
-	while (1) {
-		int ret = poll(fds, count, -1);
-		if (ret < 0) {
-			if (errno == EINTR) {
-				printf("EINTR\n");
+/* One device has events, called from the event loop */
+static void input_ready(struct Watch* w, uint32_t events) {
+	(void)events;
+	struct InputDev* dev = w->data;
+	struct InputFrame* f = &dev->frame;
+	struct input_event buf[INPUT_READ_MAX];
+
+	/* Drain the device, a short read means it is empty */
+	ssize_t n;
+	do {
+		n = read(w->fd, buf, sizeof(buf));
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			if (errno != ENODEV)
+				perror("read input");
+			remove_device(dev); /* unplugged */
+			return;
+		}
+
+		size_t got = n / sizeof(struct input_event);
+		for (size_t e = 0; e < got; e++) {
+			const struct input_event* ev = &buf[e];
+			if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+				/* The kernel lost events, the frame is incomplete */
+				f->count = 0;
+				f->dropped = 1;
 				continue;
 			}
-			perror("[BGCE] poll");
-			break;
-		}
+			if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+				if (!f->dropped)
+					handle_input_frame(dev, f->evs, f->count, event_time(dev, ev));
+				f->count = 0;
+				f->dropped = 0;
+				continue;
+			}
+			if (f->dropped)
+				continue;
 
-		for (size_t i = 0; i < count; i++) {
-			struct input_event ev;
-
-			if (fds[i].revents & POLLIN) {
-				ssize_t n = read(fds[i].fd, &ev, sizeof(ev));
-				if (n == -1) {
-					if (errno == EAGAIN || errno == EWOULDBLOCK) {
-						perror("[BGCE] read input");
-						break;
-					}
-					perror("read input");
-					break;
-				}
-				if (n != sizeof(ev))
-					break;
-
-				if (handle_input_event(ev)) {
-					continue;
-				}
-
-				if (!server.focused_client) {
-					continue;
-				}
-				struct Client c = *server.focused_client;
-
-				struct InputEvent e = {0};
-				e.device = server.input.devs[i];
-				e.code = ev.code;
-				e.value = ev.value;
-
-				switch (ev.type) {
-				case EV_KEY:
-					if (ev.code != BTN_LEFT && ev.code != BTN_RIGHT) {
-						break;
-					}
-				case EV_REL: {
-					int in = mouse_x >= c.x && mouse_x <= c.x + c.width &&
-					         mouse_y >= c.y && mouse_y <= c.y + c.height;
-					if (!in) {
-						continue;
-					}
-
-					e.x = mouse_x - c.x;
-					e.y = mouse_y - c.y;
-					break;
-				}
-				default:
-					continue;
-				}
-
-				/* Send to focused client */
-				struct BGCEMessage msg;
-				msg.type = MSG_INPUT_EVENT;
-				msg.data.input_event = e;
-				bgce_send_msg(c.fd, &msg);
+			f->evs[f->count++] = *ev;
+			if (f->count == INPUT_FRAME_MAX) {
+				/* No report in sight, do not hold them forever */
+				handle_input_frame(dev, f->evs, f->count, event_time(dev, ev));
+				f->count = 0;
 			}
 		}
-	}
-	return NULL;
+	} while (n == sizeof(buf));
 }
@@ -0,0 +1,143 @@
+#include "server.h"
+
+#include <string.h>
+#include <time.h>
+
+/*
+ * Input to photon latency. Input frames carry their kernel timestamp,
+ * CLOCK_MONOTONIC, through the server: to the cursor, to the client,
+ * back with the client's next commit, into the composition and onto
+ * the screen. Each stage adds how long it took since the input to a
+ * histogram.
+ *
+ * Histograms are log-linear: values under 8 us have a bucket each,
+ * every power of two above is split in 8, so a percentile is within
+ * 1/8 of the truth. Recording is a few relaxed atomic adds, from any
+ * thread.
+ */
+
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS ((32 - SUB_BITS + 1) * SUB_BUCKETS)
+
+struct Histogram {
+	uint64_t buckets[BUCKETS];
+	uint64_t count;
+	uint32_t max_us;
+};
+
+static struct Histogram histograms[BGCE_LATENCY_STAGES];
+
+/* Compositions not on screen yet and the oldest input in each, guarded by the server lock */
+#define INFLIGHT 8
+
+static uint64_t damage_input_ns;
+static struct {
+	uint64_t composed;
+	uint64_t input_ns;
+} inflight[INFLIGHT];
+static int inflight_count;
+
+uint64_t monotonic_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int bucket(uint32_t us) {
+	if (us < SUB_BUCKETS)
+		return us;
+	int e = 31 - __builtin_clz(us); /* >= SUB_BITS */
+	int sub = (us >> (e - SUB_BITS)) & (SUB_BUCKETS - 1);
+	return (e - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/* Largest value that falls in bucket b */
+static uint32_t bucket_max(int b) {
+	if (b < SUB_BUCKETS)
+		return b;
+	int e = b / SUB_BUCKETS + SUB_BITS - 1;
+	uint64_t low = (uint64_t)(SUB_BUCKETS + b % SUB_BUCKETS) << (e - SUB_BITS);
+	uint64_t high = low + (1ULL << (e - SUB_BITS)) - 1;
+	return high > UINT32_MAX ? UINT32_MAX : high;
+}
+
+static void record_at(int stage, uint64_t input_ns, uint64_t now_ns) {
+	if (!input_ns)
+		return;
+	uint64_t us = now_ns > input_ns ? (now_ns - input_ns) / 1000 : 0;
+	uint32_t v = us > UINT32_MAX ? UINT32_MAX : us;
+
+	struct Histogram* h = &histograms[stage];
+	__atomic_fetch_add(&h->buckets[bucket(v)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	uint32_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+	while (v > max && !__atomic_compare_exchange_n(&h->max_us, &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void record_latency(int stage, uint64_t input_ns) {
+	if (input_ns)
+		record_at(stage, input_ns, monotonic_ns());
+}
+
+void latency_damage_locked(uint64_t input_ns) {
+	if (input_ns && (!damage_input_ns || input_ns < damage_input_ns))
+		damage_input_ns = input_ns;
+}
+
+void latency_composed_locked(uint64_t composed) {
+	if (!damage_input_ns)
+		return;
+	record_latency(BGCE_LATENCY_COMPOSE, damage_input_ns);
+
+	if (inflight_count == INFLIGHT) {
+		/* Not shown for a while, the newest covers the oldest input */
+		inflight_count--;
+		if (inflight[inflight_count].input_ns < damage_input_ns)
+			damage_input_ns = inflight[inflight_count].input_ns;
+	}
+	inflight[inflight_count].composed = composed;
+	inflight[inflight_count].input_ns = damage_input_ns;
+	inflight_count++;
+	damage_input_ns = 0;
+}
+
+void latency_shown_locked(uint64_t composed, const struct timespec* when) {
+	uint64_t at = (uint64_t)when->tv_sec * 1000000000ULL + when->tv_nsec;
+	int done = 0;
+	while (done < inflight_count && inflight[done].composed <= composed) {
+		record_at(BGCE_LATENCY_PRESENT, inflight[done].input_ns, at);
+		done++;
+	}
+	inflight_count -= done;
+	memmove(inflight, inflight + done, inflight_count * sizeof(inflight[0]));
+}
+
+static uint32_t percentile(const struct Histogram* h, uint64_t count, uint32_t max, int permille) {
+	uint64_t rank = (count * permille + 999) / 1000;
+	uint64_t seen = 0;
+	for (int b = 0; b < BUCKETS; b++) {
+		seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+		if (seen >= rank) {
+			uint32_t v = bucket_max(b);
+			return v < max ? v : max;
+		}
+	}
+	return max;
+}
+
+void latency_report(struct LatencyReport* report) {
+	memset(report, 0, sizeof(*report));
+	report->stages = BGCE_LATENCY_STAGES;
+	for (int s = 0; s < BGCE_LATENCY_STAGES; s++) {
+		const struct Histogram* h = &histograms[s];
+		struct LatencyStage* out = &report->stage[s];
+		out->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+		out->max_us = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+		if (!out->count)
+			continue;
+		out->p50_us = percentile(h, out->count, out->max_us, 500);
+		out->p99_us = percentile(h, out->count, out->max_us, 990);
+	}
+}
@@ -2,35 +2,458 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
-/* Write exactly 'size' bytes */
+static void count_sent(int conn);
+
+/* Write header and payload, 'size' bytes in total, the fds go with the first byte */
+static ssize_t send_frame(int conn, uint32_t type, uint32_t serial, const void* payload, size_t length,
+                          const int* fds, int nfds) {
+	if (nfds < 0 || nfds > BGCE_MAX_FDS)
+		nfds = 0;
+	struct BGCEHeader hdr = {
+	        .version = BGCE_PROTOCOL_VERSION,
+	        .type = type,
+	        .length = length,
+	        .serial = serial,
+	        .fds = nfds,
+	};
+	struct iovec iov[2] = {
+	        {.iov_base = &hdr, .iov_len = sizeof(hdr)},
+	        {.iov_base = (void*)payload, .iov_len = length},
+	};
+	struct msghdr mh = {.msg_iov = iov, .msg_iovlen = length ? 2 : 1};
+	size_t size = sizeof(hdr) + length;
+
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * BGCE_MAX_FDS)];
+	} ctrl;
+	if (nfds > 0) {
+		memset(&ctrl, 0, sizeof(ctrl));
+		mh.msg_control = ctrl.buf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+	}
+
+	size_t sent = 0;
+	while (sent < size) {
+		/* Never die from SIGPIPE when the peer is gone */
+		ssize_t n = sendmsg(conn, &mh, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return -1;
+		}
+		sent += n;
+		mh.msg_control = NULL;
+		mh.msg_controllen = 0;
+
+		/* Skip what went out, partial writes resume mid-iovec */
+		while (mh.msg_iovlen && (size_t)n >= mh.msg_iov->iov_len) {
+			n -= mh.msg_iov->iov_len;
+			mh.msg_iov++;
+			mh.msg_iovlen--;
+		}
+		if (mh.msg_iovlen) {
+			mh.msg_iov->iov_base = (uint8_t*)mh.msg_iov->iov_base + n;
+			mh.msg_iov->iov_len -= n;
+		}
+	}
+	count_sent(conn);
+	return sent;
+}
+
+ssize_t bgce_send_fds(int conn, uint32_t type, const void* payload, size_t length, const int* fds, int nfds) {
+	return send_frame(conn, type, 0, payload, length, fds, nfds);
+}
+
+ssize_t bgce_send(int conn, uint32_t type, const void* payload, size_t length) {
+	return bgce_send_fds(conn, type, payload, length, NULL, 0);
+}
+
+size_t bgce_payload_size(const struct BGCEMessage* msg) {
+	switch (msg->type) {
+	case MSG_GET_SERVER_INFO: {
+		size_t count = msg->data.server_info.input_device_count;
+		if (count > MAX_INPUT_DEVICES)
+			count = MAX_INPUT_DEVICES;
+		return offsetof(struct ServerInfo, devices) + count * sizeof(struct InputDevice);
+	}
+	case MSG_GET_BUFFER:
+	case MSG_BUFFER_CHANGE:
+		return sizeof(struct BufferReply);
+	case MSG_INPUT_EVENT:
+		return sizeof(struct InputEvent);
+	case MSG_MOVE:
+		return sizeof(struct MoveRequest);
+	case MSG_SUBMIT:
+	case MSG_BUFFER_RELEASE:
+		return sizeof(struct BufferIndex);
+	case MSG_FRAME_DONE:
+		return sizeof(struct FrameDone);
+	case MSG_GET_LATENCY:
+		return sizeof(struct LatencyReport);
+	case MSG_DRAW_RECTS: {
+		size_t count = msg->data.draw_rects.count;
+		if (count > BGCE_MAX_DRAW_RECTS)
+			count = BGCE_MAX_DRAW_RECTS;
+		return offsetof(struct DrawRects, rects) + count * sizeof(struct BGCERect);
+	}
+	default:
+		return 0;
+	}
+}
+
 ssize_t bgce_send_msg(int conn, struct BGCEMessage* msg) {
-	size_t size = sizeof(struct BGCEMessage);
+	return send_frame(conn, msg->type, msg->serial, &msg->data, bgce_payload_size(msg), NULL, 0);
+}
+
+/* A message read while waiting for another one */
+struct Deferred {
+	struct BGCEMessage msg;
+	struct Deferred* next;
+};
+
+/* A request whose reply goes to a callback, see bgce_request() */
+struct Pending {
+	uint32_t serial;
+	void (*done)(struct BGCEMessage* reply, void* data);
+	void* data;
+	struct Pending* next;
+};
+
+#define FD_QUEUE (BGCE_MAX_FDS * 4)
+
+/* What the library keeps per connection, created on first use */
+struct Connection {
+	int conn;
+
+	/* Bytes of messages not handled yet, and the fds that came with
+	 * them in order, each header says how many are its own */
+	uint8_t in[BGCE_MAX_MSG_SIZE];
+	size_t in_len;
+	int fds[FD_QUEUE];
+	int nfds;
+
+	/* Command ring, see bgce_enable_ring() */
+	struct BGCERing* ring;
+	int doorbell;
+	uint32_t sent; /* socket messages since the ring was set up */
+
+	/* See bgce_request_frame() */
+	void (*frame_done)(const struct FrameDone* done, void* data);
+	void* frame_data;
+
+	/* Requests of the open transaction, NULL outside one */
+	uint8_t* batch;
+	size_t batch_len;
+
+	/* Returned by bgce_recv_msg() before reading more */
+	struct Deferred* deferred;
+	struct Deferred** deferred_tail;
+
+	/* See bgce_request() and bgce_set_event_handler() */
+	uint32_t serial;
+	struct Pending* pending;
+	void (*event)(struct BGCEMessage* msg, void* data);
+	void* event_data;
+
+	struct Connection* next;
+};
 
-	ssize_t n = write(conn, msg, size);
-	if (n < 0) {
+static struct Connection* connections;
+
+static struct Connection* find_connection(int conn, int create) {
+	for (struct Connection* c = connections; c; c = c->next) {
+		if (c->conn == conn)
+			return c;
+	}
+	if (!create)
+		return NULL;
+
+	struct Connection* c = calloc(1, sizeof(struct Connection));
+	if (!c) {
+		perror("calloc (connection)");
+		return NULL;
+	}
+	c->conn = conn;
+	c->doorbell = -1;
+	c->deferred_tail = &c->deferred;
+	c->next = connections;
+	connections = c;
+	return c;
+}
+
+/* Ring commands wait on the server for the socket messages sent before them */
+static void count_sent(int conn) {
+	struct Connection* c = find_connection(conn, 0);
+	if (c && c->ring)
+		c->sent++;
+}
+
+/* Queue the fds passed in mh, closing those that do not fit */
+static void take_fds(struct Connection* c, struct msghdr* mh) {
+	for (struct cmsghdr* cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i = 0; i < n; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+			if (c->nfds < FD_QUEUE)
+				c->fds[c->nfds++] = fd;
+			else
+				close(fd);
+		}
+	}
+}
+
+/*
+ * Read what the socket has into the buffer of c, when block waiting
+ * for at least a byte. Returns the bytes read, 0 on end of file or -1
+ * on error, with errno EAGAIN when there is nothing yet.
+ */
+static ssize_t fill(struct Connection* c, int block) {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * BGCE_MAX_FDS)];
+	} ctrl;
+
+	while (1) {
+		struct iovec iov = {.iov_base = c->in + c->in_len, .iov_len = sizeof(c->in) - c->in_len};
+		struct msghdr mh = {
+		        .msg_iov = &iov,
+		        .msg_iovlen = 1,
+		        .msg_control = ctrl.buf,
+		        .msg_controllen = sizeof(ctrl.buf),
+		};
+		ssize_t n = recvmsg(c->conn, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+		if (n >= 0) {
+			take_fds(c, &mh);
+			c->in_len += n;
+			return n;
+		}
 		if (errno == EINTR)
-			perror("write");
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("read");
+			return -1;
+		}
+		if (!block)
+			return -1;
+
+		/* Also when the application made the socket non-blocking */
+		struct pollfd pfd = {.fd = c->conn, .events = POLLIN};
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			perror("poll");
+			return -1;
+		}
+	}
+}
+
+static int check_header(const struct BGCEHeader* hdr) {
+	if (hdr->version != BGCE_PROTOCOL_VERSION) {
+		fprintf(stderr, "[BGCE] Protocol version %u, expected %u\n",
+		        hdr->version, BGCE_PROTOCOL_VERSION);
+		errno = EPROTO;
+		return -1;
+	}
+	if (hdr->length > BGCE_MAX_MSG_SIZE - sizeof(*hdr)) {
+		fprintf(stderr, "[BGCE] Message of %u bytes is too long\n", hdr->length);
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t bgce_parse_msg(const void* buf, size_t len, struct BGCEMessage* msg) {
+	struct BGCEHeader hdr;
+	if (len < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (check_header(&hdr) < 0)
+		return -1;
+	if (len < sizeof(hdr) + hdr.length)
+		return 0;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->type = hdr.type;
+	msg->serial = hdr.serial;
+	size_t keep = hdr.length < sizeof(msg->data) ? hdr.length : sizeof(msg->data);
+	memcpy(&msg->data, (const uint8_t*)buf + sizeof(hdr), keep);
+
+	return sizeof(hdr) + hdr.length;
+}
+
+/*
+ * Take the next message of c with its fds, reading more when block or
+ * the socket has some. Returns like bgce_recv_msg().
+ */
+static ssize_t read_msg(struct Connection* c, struct BGCEMessage* msg, int* fds, int* nfds, int block) {
+	*nfds = 0;
+	ssize_t used;
+	while ((used = bgce_parse_msg(c->in, c->in_len, msg)) == 0) {
+		ssize_t n = fill(c, block);
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			if (c->in_len == 0)
+				return 0;
+			errno = EPROTO; /* closed mid-message */
+			return -1;
+		}
+	}
+	if (used < 0)
+		return -1;
+
+	struct BGCEHeader hdr;
+	memcpy(&hdr, c->in, sizeof(hdr));
+	int own = hdr.fds < c->nfds ? hdr.fds : c->nfds;
+	for (int i = 0; i < own; i++) {
+		if (i < BGCE_MAX_FDS)
+			fds[(*nfds)++] = c->fds[i];
+		else
+			close(c->fds[i]);
+	}
+	c->nfds -= own;
+	memmove(c->fds, c->fds + own, c->nfds * sizeof(int));
+
+	c->in_len -= used;
+	memmove(c->in, c->in + used, c->in_len);
+	return used;
+}
+
+ssize_t bgce_recv_msg_fds(int conn, struct BGCEMessage* msg, int* fds, int* nfds) {
+	struct Connection* c = find_connection(conn, 1);
+	if (!c)
 		return -1;
+
+	int scratch[BGCE_MAX_FDS];
+	int n = 0;
+	ssize_t got = read_msg(c, msg, fds ? fds : scratch, &n, 1);
+	if (!fds) {
+		for (int i = 0; i < n; i++)
+			close(scratch[i]);
+	}
+	if (nfds)
+		*nfds = fds ? n : 0;
+	return got;
+}
+
+/* Hand buffer replies their fd, close others and call frame callbacks */
+static void take_msg(struct Connection* c, struct BGCEMessage* msg, const int* fds, int nfds) {
+	int first = 0;
+	if (msg->type == MSG_GET_BUFFER || msg->type == MSG_BUFFER_CHANGE) {
+		msg->data.buffer_reply.fd = nfds ? fds[0] : -1;
+		first = 1;
 	}
+	for (int i = first; i < nfds; i++)
+		close(fds[i]);
+
+	if (msg->type == MSG_FRAME_DONE && c->frame_done) {
+		void (*done)(const struct FrameDone*, void*) = c->frame_done;
+		c->frame_done = NULL; /* one shot, it may ask again */
+		done(&msg->data.frame_done, c->frame_data);
+	}
+}
+
+/* Read one message, handing buffer replies their fd */
+static ssize_t recv_msg(struct Connection* c, struct BGCEMessage* msg, int block) {
+	int fds[BGCE_MAX_FDS];
+	int nfds;
+	ssize_t n = read_msg(c, msg, fds, &nfds, block);
+	if (n > 0)
+		take_msg(c, msg, fds, nfds);
 	return n;
 }
 
+/* Returned by bgce_recv_msg() and bgce_dispatch() before reading more */
+static int undefer_msg(struct Connection* c, struct BGCEMessage* msg) {
+	struct Deferred* d = c->deferred;
+	if (!d)
+		return 0;
+	c->deferred = d->next;
+	if (!c->deferred)
+		c->deferred_tail = &c->deferred;
+	*msg = d->msg;
+	free(d);
+	return 1;
+}
+
 ssize_t bgce_recv_msg(int conn, struct BGCEMessage* msg) {
-	ssize_t n = read(conn, msg, sizeof(struct BGCEMessage));
-	if (n < 0) {
-		if (errno == EINTR)
-			perror("read");
+	struct Connection* c = find_connection(conn, 1);
+	if (!c)
 		return -1;
+	if (undefer_msg(c, msg))
+		return sizeof(struct BGCEHeader) + bgce_payload_size(msg);
+
+	return recv_msg(c, msg, 1);
+}
+
+/* Keep msg for a later bgce_recv_msg() */
+static void defer_msg(struct Connection* c, const struct BGCEMessage* msg) {
+	struct Deferred* d = malloc(sizeof(struct Deferred));
+	if (!d) {
+		fprintf(stderr, "[BGCE] Dropping message of type %u\n", msg->type);
+		return;
+	}
+
+	d->msg = *msg;
+	d->next = NULL;
+	*c->deferred_tail = d;
+	c->deferred_tail = &d->next;
+}
+
+static uint32_t next_serial(struct Connection* c) {
+	if (++c->serial == 0)
+		c->serial = 1; /* 0 is for events */
+	return c->serial;
+}
+
+/*
+ * Send a request and wait for its reply, keeping the messages read
+ * meanwhile. The fds of the reply go to fds, room for BGCE_MAX_FDS,
+ * or to the buffer reply when fds is NULL. Returns 0 or -1.
+ */
+static int call(int conn, uint32_t type, const void* payload, size_t length,
+                struct BGCEMessage* reply, int* fds, int* nfds) {
+	struct Connection* c = find_connection(conn, 1);
+	if (!c)
+		return -1;
+
+	uint32_t serial = next_serial(c);
+	if (send_frame(conn, type, serial, payload, length, NULL, 0) <= 0)
+		return -1;
+
+	while (1) {
+		int got[BGCE_MAX_FDS];
+		int n;
+		if (read_msg(c, reply, got, &n, 1) <= 0)
+			return -1;
+		if (reply->serial == serial && fds) {
+			memcpy(fds, got, n * sizeof(int));
+			*nfds = n;
+			return 0;
+		}
+		take_msg(c, reply, got, n);
+		if (reply->serial == serial)
+			return 0;
+		defer_msg(c, reply);
 	}
-	return n;
 }
 
 /* Connect to the BGCE server */
@@ -60,67 +483,323 @@ int bgce_get_server_info(int conn, struct ServerInfo* info) {
 	if (conn < 0)
 		return -1;
 
-	struct BGCEMessage msg = {0};
-	msg.type = MSG_GET_SERVER_INFO;
-
-	if (bgce_send_msg(conn, &msg) <= 0)
+	struct BGCEMessage msg;
+	if (call(conn, MSG_GET_SERVER_INFO, NULL, 0, &msg, NULL, NULL) < 0)
 		return -2;
 
-	if (bgce_recv_msg(conn, &msg) <= 0)
-		return -3;
-
 	*info = msg.data.server_info;
 
 	return 0;
 }
 
-/* Public API: Get shared buffer */
-void* bgce_get_buffer(int conn, struct BufferRequest req) {
+int bgce_get_latency(int conn, struct LatencyReport* report) {
 	if (conn < 0)
-		return NULL;
+		return -1;
 
 	struct BGCEMessage msg;
-	msg.type = MSG_GET_BUFFER;
-	msg.data.buffer_request = req;
-
-	int code = bgce_send_msg(conn, &msg);
-	if (code <= 0)
-		return NULL;
-
-	if (bgce_recv_msg(conn, &msg) <= 0)
-		return NULL;
+	if (call(conn, MSG_GET_LATENCY, NULL, 0, &msg, NULL, NULL) < 0)
+		return -1;
 
-	struct BufferReply reply;
-	reply = msg.data.buffer_reply;
+	*report = msg.data.latency_report;
+	return 0;
+}
 
-	size_t size = reply.width * reply.height * 4;
-	int shm_fd = shm_open(reply.shm_name, O_RDWR, 0600);
-	if (shm_fd < 0) {
-		perror("shm_open (client)");
+/* Map size bytes of the memfd that came with reply, consuming it */
+static void* map_reply(struct BufferReply* reply, size_t size) {
+	int fd = reply->fd;
+	reply->fd = -1;
+	if (reply->status != 0 || fd < 0) {
+		fprintf(stderr, "[BGCE] No buffer in the reply\n");
+		if (fd >= 0)
+			close(fd);
 		return NULL;
 	}
 
-	void* buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	void* buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
 	if (buf == MAP_FAILED) {
 		perror("mmap (client)");
-		close(shm_fd);
 		return NULL;
 	}
 
 	return buf;
 }
 
+/* Public API: Map a buffer the server created */
+void* bgce_map_buffer(struct BufferReply* reply) {
+	return map_reply(reply, (size_t)reply->stride * reply->height);
+}
+
+/* Public API: Get shared buffer */
+void* bgce_get_buffer_reply(int conn, struct BufferRequest req, struct BufferReply* reply) {
+	if (conn < 0)
+		return NULL;
+
+	struct BGCEMessage msg;
+	if (call(conn, MSG_GET_BUFFER, &req, sizeof(req), &msg, NULL, NULL) < 0)
+		return NULL;
+
+	*reply = msg.data.buffer_reply;
+	return bgce_map_buffer(reply);
+}
+
+void* bgce_get_buffer(int conn, struct BufferRequest req) {
+	struct BufferReply reply;
+	return bgce_get_buffer_reply(conn, req, &reply);
+}
+
+int bgce_map_swapchain(struct BGCESwapchain* sc, struct BufferReply* reply) {
+	if (reply->buffers < 2 || reply->buffers > BGCE_MAX_BUFFERS) {
+		fprintf(stderr, "[BGCE] Reply has %u buffers, not a swapchain\n", reply->buffers);
+		if (reply->fd >= 0)
+			close(reply->fd);
+		reply->fd = -1;
+		return -1;
+	}
+
+	size_t image = (size_t)reply->stride * reply->height;
+	size_t size = sizeof(struct BGCESwapchainState) + image * reply->buffers;
+	uint8_t* map = map_reply(reply, size);
+	if (!map)
+		return -1;
+
+	if (sc->map)
+		munmap(sc->map, sc->size);
+	sc->map = map;
+	sc->size = size;
+	sc->state = (struct BGCESwapchainState*)map;
+	sc->width = reply->width;
+	sc->height = reply->height;
+	sc->stride = reply->stride;
+	sc->count = reply->buffers;
+	for (uint32_t i = 0; i < sc->count; i++)
+		sc->buffers[i] = map + sizeof(struct BGCESwapchainState) + image * i;
+	return 0;
+}
+
+int bgce_get_swapchain(int conn, struct BufferRequest req, struct BGCESwapchain* sc) {
+	if (conn < 0)
+		return -1;
+
+	memset(sc, 0, sizeof(*sc));
+	sc->conn = conn;
+
+	struct BGCEMessage msg;
+	if (call(conn, MSG_GET_BUFFER, &req, sizeof(req), &msg, NULL, NULL) < 0)
+		return -1;
+
+	return bgce_map_swapchain(sc, &msg.data.buffer_reply);
+}
+
+static int try_acquire(struct BGCESwapchain* sc) {
+	for (uint32_t i = 0; i < sc->count; i++) {
+		uint32_t expected = BGCE_OWNER_FREE;
+		if (__atomic_compare_exchange_n(&sc->state->owner[i], &expected, BGCE_OWNER_CLIENT,
+		                                0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return i;
+	}
+	return -1;
+}
+
+int bgce_acquire_buffer(struct BGCESwapchain* sc) {
+	if (!sc->state)
+		return -1;
+
+	int i = try_acquire(sc);
+	if (i >= 0)
+		return i;
+
+	/* Pairs with the server freeing an image, then looking at waiting */
+	__atomic_store_n(&sc->state->waiting, 1, __ATOMIC_SEQ_CST);
+	i = try_acquire(sc);
+	if (i >= 0)
+		__atomic_store_n(&sc->state->waiting, 0, __ATOMIC_RELAXED);
+	return i;
+}
+
+/* Public API: Set up the command ring */
+int bgce_enable_ring(int conn) {
+	if (conn < 0)
+		return -1;
+	struct Connection* c = find_connection(conn, 0);
+	if (c && c->ring)
+		return 0;
+
+	struct BGCEMessage msg;
+	int fds[BGCE_MAX_FDS];
+	int nfds;
+	if (call(conn, MSG_SETUP_RING, NULL, 0, &msg, fds, &nfds) < 0)
+		return -1;
+	if (msg.type != MSG_SETUP_RING || nfds != 2) {
+		for (int i = 0; i < nfds; i++)
+			close(fds[i]);
+		return -1;
+	}
+
+	c = find_connection(conn, 1);
+	void* map = mmap(NULL, sizeof(struct BGCERing), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if (!c || map == MAP_FAILED) {
+		perror("mmap (ring)");
+		if (map != MAP_FAILED)
+			munmap(map, sizeof(struct BGCERing));
+		close(fds[1]);
+		return -1;
+	}
+
+	c->ring = map;
+	c->doorbell = fds[1];
+	c->sent = 0;
+	return 0;
+}
+
+/*
+ * Queue a command on the ring, returns -1 when there is no ring or it
+ * is full so the caller uses the socket. The command carries the count
+ * of socket messages sent so far, see struct BGCECommand, which keeps
+ * it in order with them.
+ */
+static int ring_push(int conn, const struct BGCECommand* cmd) {
+	struct Connection* c = find_connection(conn, 0);
+	if (!c || !c->ring)
+		return -1;
+
+	struct BGCERing* ring = c->ring;
+	uint32_t head = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= BGCE_RING_ENTRIES)
+		return -1;
+
+	ring->cmds[head & (BGCE_RING_ENTRIES - 1)] = *cmd;
+	ring->cmds[head & (BGCE_RING_ENTRIES - 1)].sent = c->sent;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the server setting sleeping, then looking at head */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(c->doorbell, &one, sizeof(one)) < 0)
+			perror("write (doorbell)");
+	}
+	return 0;
+}
+
+/* Append msg to the open transaction of c */
+static int batch_msg(struct Connection* c, const struct BGCEMessage* msg) {
+	struct BGCEHeader hdr = {
+	        .version = BGCE_PROTOCOL_VERSION,
+	        .type = msg->type,
+	        .length = bgce_payload_size(msg),
+	};
+	if (c->batch_len + sizeof(hdr) + hdr.length > BGCE_MAX_TRANSACTION) {
+		fprintf(stderr, "[BGCE] Transaction is full\n");
+		errno = ENOSPC;
+		return -1;
+	}
+
+	memcpy(c->batch + c->batch_len, &hdr, sizeof(hdr));
+	memcpy(c->batch + c->batch_len + sizeof(hdr), &msg->data, hdr.length);
+	c->batch_len += sizeof(hdr) + hdr.length;
+	return 0;
+}
+
+/* Send msg, or keep it for bgce_commit() inside a transaction */
+static int send_request_msg(int conn, struct BGCEMessage* msg) {
+	struct Connection* c = find_connection(conn, 0);
+	if (c && c->batch)
+		return batch_msg(c, msg);
+
+	return bgce_send_msg(conn, msg) > 0 ? 0 : -1;
+}
+
+/* Requests go into the open transaction, else the ring, else the socket */
+static int send_request(int conn, const struct BGCECommand* cmd) {
+	struct Connection* c = find_connection(conn, 0);
+	if (!(c && c->batch) && ring_push(conn, cmd) == 0)
+		return 0;
+
+	struct BGCEMessage msg = {.type = cmd->type};
+	switch (cmd->type) {
+	case MSG_MOVE:
+		msg.data.move_request = cmd->data.move_request;
+		break;
+	case MSG_SUBMIT:
+		msg.data.buffer_index = cmd->data.buffer_index;
+		break;
+	case MSG_DRAW_RECTS:
+		msg.data.draw_rects.count = 1;
+		msg.data.draw_rects.rects[0] = cmd->data.rect;
+		break;
+	}
+	return send_request_msg(conn, &msg);
+}
+
+int bgce_begin(int conn) {
+	struct Connection* c = find_connection(conn, 1);
+	if (!c)
+		return -1;
+	if (c->batch) {
+		fprintf(stderr, "[BGCE] Transaction already open\n");
+		return -1;
+	}
+
+	c->batch = malloc(BGCE_MAX_TRANSACTION);
+	if (!c->batch) {
+		perror("malloc (transaction)");
+		return -1;
+	}
+	c->batch_len = 0;
+	return 0;
+}
+
+int bgce_commit(int conn) {
+	struct Connection* c = find_connection(conn, 0);
+	if (!c || !c->batch)
+		return -1;
+
+	/* Header and requests leave in one sendmsg, and it counts as a
+	 * socket message: ring commands after it wait for it */
+	ssize_t n = bgce_send(conn, MSG_TRANSACTION, c->batch, c->batch_len);
+	free(c->batch);
+	c->batch = NULL;
+	c->batch_len = 0;
+	return n > 0 ? 0 : -1;
+}
+
 /* Public API: Draw current buffer */
 int bgce_draw(int conn) {
 	if (conn < 0)
 		return -1;
 
-	struct BGCEMessage msg = {0};
-	msg.type = MSG_DRAW;
+	struct BGCECommand cmd = {.type = MSG_DRAW};
+	return send_request(conn, &cmd);
+}
 
-	if (bgce_send_msg(conn, &msg) <= 0)
+int bgce_draw_rects(int conn, const struct BGCERect* rects, size_t n) {
+	if (conn < 0)
 		return -1;
 
+	/* The ring takes them one by one, the server merges them again */
+	struct Connection* c = find_connection(conn, 0);
+	size_t i = 0;
+	for (; i < n && !(c && c->batch); i++) {
+		struct BGCECommand cmd = {.type = MSG_DRAW_RECTS};
+		cmd.data.rect = rects[i];
+		if (ring_push(conn, &cmd) < 0)
+			break;
+	}
+
+	while (i < n) {
+		struct BGCEMessage msg = {0};
+		msg.type = MSG_DRAW_RECTS;
+		size_t count = n - i < BGCE_MAX_DRAW_RECTS ? n - i : BGCE_MAX_DRAW_RECTS;
+		msg.data.draw_rects.count = count;
+		memcpy(msg.data.draw_rects.rects, rects + i, count * sizeof(struct BGCERect));
+		if (send_request_msg(conn, &msg) < 0)
+			return -1;
+		i += count;
+	}
+
 	return 0;
 }
 
@@ -128,19 +807,199 @@ int bgce_move(int conn, int x, int y) {
 	if (conn < 0)
 		return -1;
 
-	struct BGCEMessage msg = {0};
-	msg.type = MSG_MOVE;
-	msg.data.move_request.x = x;
-	msg.data.move_request.y = y;
+	struct BGCECommand cmd = {.type = MSG_MOVE};
+	cmd.data.move_request.x = x;
+	cmd.data.move_request.y = y;
+	return send_request(conn, &cmd);
+}
 
-	if (bgce_send_msg(conn, &msg) <= 0)
+int bgce_submit_buffer(struct BGCESwapchain* sc, int index) {
+	if (!sc->state || index < 0 || (uint32_t)index >= sc->count)
 		return -1;
 
-	return 0;
+	/* The server reads it from now on */
+	__atomic_store_n(&sc->state->owner[index], BGCE_OWNER_SERVER, __ATOMIC_RELEASE);
+
+	struct BGCECommand cmd = {.type = MSG_SUBMIT};
+	cmd.data.buffer_index.index = index;
+	return send_request(sc->conn, &cmd);
+}
+
+void bgce_release_swapchain(struct BGCESwapchain* sc) {
+	if (sc->map)
+		munmap(sc->map, sc->size);
+	memset(sc, 0, sizeof(*sc));
+}
+
+int bgce_request_frame(int conn, void (*done)(const struct FrameDone* done, void* data), void* data) {
+	struct Connection* c = find_connection(conn, 1);
+	if (!c)
+		return -1;
+	c->frame_done = done;
+	c->frame_data = data;
+
+	/* Same path as the commit it goes with, or it may come after it */
+	struct BGCECommand cmd = {.type = MSG_FRAME};
+	return send_request(conn, &cmd);
+}
+
+int bgce_wait_frame(int conn, struct FrameDone* done) {
+	struct Connection* c = find_connection(conn, 1);
+	if (!c)
+		return -1;
+
+	/* A blocking call may have read it already */
+	for (struct Deferred** p = &c->deferred; *p; p = &(*p)->next) {
+		struct Deferred* d = *p;
+		if (d->msg.type != MSG_FRAME_DONE)
+			continue;
+		if (done)
+			*done = d->msg.data.frame_done;
+		*p = d->next;
+		if (!*p)
+			c->deferred_tail = p;
+		free(d);
+		return 0;
+	}
+
+	while (1) {
+		struct BGCEMessage msg;
+		if (recv_msg(c, &msg, 1) <= 0)
+			return -1;
+		if (msg.type == MSG_FRAME_DONE) {
+			if (done)
+				*done = msg.data.frame_done;
+			return 0;
+		}
+		defer_msg(c, &msg);
+	}
+}
+
+/* Close the buffer fd of msg, nobody takes it */
+static void drop_msg(struct BGCEMessage* msg) {
+	int buffer = msg->type == MSG_GET_BUFFER || msg->type == MSG_BUFFER_CHANGE;
+	if (buffer && msg->data.buffer_reply.fd >= 0)
+		close(msg->data.buffer_reply.fd);
+	msg->data.buffer_reply.fd = -1;
+}
+
+int bgce_get_fd(int conn) {
+	return conn;
+}
+
+uint32_t bgce_request(int conn, uint32_t type, const void* payload, size_t length,
+                      void (*done)(struct BGCEMessage* reply, void* data), void* data) {
+	/* Its reply installs the ring, only bgce_enable_ring() does that */
+	if (type == MSG_SETUP_RING) {
+		fprintf(stderr, "[BGCE] Use bgce_enable_ring() to set up the ring\n");
+		errno = EINVAL;
+		return 0;
+	}
+
+	struct Connection* c = find_connection(conn, 1);
+	struct Pending* p = malloc(sizeof(struct Pending));
+	if (!c || !p) {
+		perror("malloc (request)");
+		free(p);
+		return 0;
+	}
+
+	p->serial = next_serial(c);
+	if (send_frame(conn, type, p->serial, payload, length, NULL, 0) <= 0) {
+		free(p);
+		return 0;
+	}
+	p->done = done;
+	p->data = data;
+	p->next = c->pending;
+	c->pending = p;
+	return p->serial;
+}
+
+void bgce_set_event_handler(int conn, void (*handler)(struct BGCEMessage* msg, void* data), void* data) {
+	struct Connection* c = find_connection(conn, 1);
+	if (!c)
+		return;
+	c->event = handler;
+	c->event_data = data;
+}
+
+/* Give msg to the callback of its request or the event handler */
+static void deliver(struct Connection* c, struct BGCEMessage* msg) {
+	if (msg->serial == 0) {
+		if (c->event)
+			c->event(msg, c->event_data);
+		else
+			drop_msg(msg);
+		return;
+	}
+
+	for (struct Pending** p = &c->pending; *p; p = &(*p)->next) {
+		struct Pending* req = *p;
+		if (req->serial != msg->serial)
+			continue;
+		*p = req->next;
+		if (req->done)
+			req->done(msg, req->data);
+		else
+			drop_msg(msg);
+		free(req);
+		return;
+	}
+	drop_msg(msg); /* a reply nobody waits for */
+}
+
+int bgce_dispatch(int conn) {
+	if (!find_connection(conn, 1))
+		return -1;
+
+	int count = 0;
+	struct Connection* c;
+	/* Callbacks may disconnect, look it up again every time */
+	while ((c = find_connection(conn, 0))) {
+		struct BGCEMessage msg;
+		if (!undefer_msg(c, &msg)) {
+			ssize_t n = recv_msg(c, &msg, 0);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if (n <= 0)
+				return -1;
+		}
+		deliver(c, &msg);
+		count++;
+	}
+	return count;
 }
 
 /* Public API: Disconnect */
 void bgce_disconnect(int conn) {
+	for (struct Connection** p = &connections; *p; p = &(*p)->next) {
+		struct Connection* c = *p;
+		if (c->conn != conn)
+			continue;
+		*p = c->next;
+		if (c->ring) {
+			munmap(c->ring, sizeof(struct BGCERing));
+			close(c->doorbell);
+		}
+		free(c->batch);
+		while (c->deferred) {
+			struct Deferred* d = c->deferred;
+			c->deferred = d->next;
+			drop_msg(&d->msg);
+			free(d);
+		}
+		while (c->pending) {
+			struct Pending* req = c->pending;
+			c->pending = req->next;
+			free(req);
+		}
+		for (int i = 0; i < c->nfds; i++)
+			close(c->fds[i]);
+		free(c);
+		break;
+	}
+
 	if (conn >= 0) {
 		close(conn);
 	}
@@ -3,154 +3,101 @@
 #include "bgce.h"
 #include "server.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
-#include <time.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+/*
+ * The event loop: a single thread waits on every fd the server has,
+ * the listening socket, client connections, input devices and the
+ * display, and calls the watch ready for each. Compositing runs on
+ * its own thread, see scheduler.c.
+ */
+
 /* Externs from server.c */
 extern struct ServerState server;
 
-void* client_thread(void* arg) {
-	int client_fd = *(int*)arg;
-	free(arg);
-
-	// Allocate memory for the client
-	struct Client* client = calloc(1, sizeof(struct Client));
-	if (!client) {
-		perror("Failed to allocate memory for client");
-		close(client_fd);
-		return NULL;
-	}
+static int epoll_fd = -1;
 
-	client->fd = client_fd;
-
-	// Add client to the linked list
-	client->next = server.clients;
-	client->z = server.clients->z + 1;
-	server.clients = client;
-	server.focused_client = client; /* last connected client gets focus */
+/* Clients disconnected in this round, freed once no event refers to them */
+static struct Client* dead_clients;
 
-	if (!client) {
-		fprintf(stderr, "[BGCE] No available client slots\n");
-		close(client_fd);
-		return NULL;
+int init_loop(void) {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("[BGCE] epoll_create1");
+		return -1;
 	}
+	return 0;
+}
 
-	printf("[BGCE] Thread started for client fd=%d z=%d\n", client_fd, client->z);
-
-	while (1) {
-		struct BGCEMessage msg;
-		ssize_t rc = bgce_recv_msg(client_fd, &msg);
-		if (rc <= 0) {
-			printf("[BGCE] Client disconnected (fd=%d)\n", client_fd);
-			break;
-		}
-
-		switch (msg.type) {
-		case MSG_GET_SERVER_INFO: {
-			struct ServerInfo info = {
-			        .width = server.display_w,
-			        .height = server.display_h,
-			        .color_depth = server.display_bpp,
-			        .input_device_count = server.input.count,
-			};
-			for (int d = 0; d < server.input.count; d++) {
-				info.devices[d] = server.input.devs[d];
-			}
-
-			msg.data.server_info = info;
-			bgce_send_msg(client_fd, &msg);
-			break;
-		}
+int watch_fd(struct Watch* w, uint32_t events) {
+	struct epoll_event ev = {.events = events, .data.ptr = w};
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->fd, &ev) < 0) {
+		perror("[BGCE] epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
 
-		case MSG_GET_BUFFER: {
-			struct BufferRequest req = msg.data.buffer_request;
-			printf(
-			        "[BGCE] Client requested buffer of size %dx%d\n",
-			        req.width,
-			        req.height);
-
-			snprintf(client->shm_name, sizeof(client->shm_name),
-			         "bgce_buf_%d_%ld", getpid(), time(NULL));
-
-			// Unmap and unlink the existing buffer: for resize
-			if (client->buffer) {
-				printf("[BGCE] Client already has a buffer, unmapping.\n");
-				munmap(client->buffer, client->width * client->height * 4);
-				shm_unlink(client->shm_name);
-			}
+int rewatch_fd(struct Watch* w, uint32_t events) {
+	struct epoll_event ev = {.events = events, .data.ptr = w};
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, w->fd, &ev) < 0) {
+		perror("[BGCE] epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
 
-			int shm_fd = shm_open(client->shm_name, O_CREAT | O_RDWR, 0600);
-			if (shm_fd < 0) {
-				perror("shm_open");
-				break;
-			}
+void unwatch_fd(struct Watch* w) {
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+	w->fd = -1;
+}
 
-			size_t buf_size = req.width * req.height * 4;
-			if (ftruncate(shm_fd, buf_size) < 0) {
-				perror("ftruncate");
-				close(shm_fd);
-				break;
-			}
+void run_loop(void) {
+	struct epoll_event events[32];
 
-			client->buffer = mmap(NULL, buf_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-			client->width = req.width;
-			client->height = req.height;
-			client->x = 0;
-			client->y = 0;
-			close(shm_fd);
-			printf("[BGCE] Client buffer: %p size=%zu (%dx%d) name=%s\n",
-			       client->buffer,
-			       client->width * client->height * 4UL,
-			       client->width, client->height,
-			       client->shm_name);
-
-			struct BufferReply reply = {0};
-			strncpy(reply.shm_name, client->shm_name, sizeof(reply.shm_name));
-			reply.width = req.width;
-			reply.height = req.height;
-			msg.data.buffer_reply = reply;
-			bgce_send_msg(client_fd, &msg);
+	while (1) {
+		park_rings();
+		int n = epoll_wait(epoll_fd, events, 32, -1);
+		unpark_rings();
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("[BGCE] epoll_wait");
 			break;
 		}
 
-		case MSG_DRAW: {
-			printf("[BGCE] Received draw event from client %s\n", client->shm_name);
-			if (client_fd != server.focused_client->fd) {
-				printf("[BGCE] Client is not focused!\n");
-				break;
-			}
-
-			draw(&server, *client);
-			break;
+		for (int i = 0; i < n; i++) {
+			struct Watch* w = events[i].data.ptr;
+			if (w->fd >= 0)
+				w->ready(w, events[i].events);
 		}
-		case MSG_MOVE: {
-			struct MoveRequest move_req = msg.data.move_request;
-			printf(
-				"[BGCE] Client requested move to position (%d, %d)\n",
-				move_req.x, move_req.y);
-
-			// Update client position
-			client->x = move_req.x;
-			client->y = move_req.y;
 
-			break;
-		}
-		default:
-			fprintf(stderr, "[BGCE] Unknown message type %d\n", msg.type);
+		while (dead_clients) {
+			struct Client* c = dead_clients;
+			dead_clients = c->next;
+			free(c);
 		}
 	}
+}
 
-	if (client->buffer) {
-		munmap(client->buffer, client->width * client->height * 4);
-		shm_unlink(client->shm_name);
-	}
+static void remove_client(struct Client* client) {
+	printf("[BGCE] Client disconnected (fd=%d)\n", client->watch.fd);
+	unwatch_fd(&client->watch);
+	release_ring(client);
+	release_queue(client);
+	forget_input_client(client);
+	grid_remove(client);
 
 	// Remove client from the linked list
+	pthread_mutex_lock(&server.lock);
 	struct Client* prev = NULL;
 	struct Client* curr = server.clients;
 	while (curr) {
@@ -165,14 +112,244 @@ void* client_thread(void* arg) {
 		prev = curr;
 		curr = curr->next;
 	}
+	pthread_mutex_unlock(&server.lock);
 
 	if (server.focused_client == client) {
 		server.focused_client = NULL;
 	}
 
+	// Uncover whatever was behind the window
+	update_visibility(&server);
+	region_fini(&client->visible);
+	if (client->buffer) {
+		damage_client(&server, client);
+		schedule_frame(&server);
+
+		munmap(client->map, client->map_size);
+	}
+
 	close(client->fd);
 
-	printf("[BGCE] Thread exiting for client fd=%d\n", client->fd);
-	free(client);
-	return NULL;
+	client->next = dead_clients;
+	dead_clients = client;
+}
+
+void handle_message(struct Client* client, struct BGCEMessage* msg) {
+	switch (msg->type) {
+	case MSG_GET_SERVER_INFO: {
+		struct ServerInfo info = {
+		        .width = server.display_w,
+		        .height = server.display_h,
+		        .color_depth = server.display_bpp,
+		};
+		info.input_device_count = list_input_devices(info.devices, MAX_INPUT_DEVICES);
+
+		msg->data.server_info = info;
+		client_send_msg(client, msg);
+		break;
+	}
+
+	case MSG_GET_BUFFER: {
+		struct BufferRequest req = msg->data.buffer_request;
+		printf(
+		        "[BGCE] Client requested buffer of size %dx%d\n",
+		        req.width,
+		        req.height);
+
+		struct BufferReply reply = {.status = -1};
+		move_client(&server, client, 0, 0);
+		int buf_fd = allocate_buffers(client, req.width, req.height, req.buffers, req.flags);
+		if (buf_fd < 0) {
+			msg->data.buffer_reply = reply;
+			client_send_msg(client, msg);
+			break;
+		}
+		printf("[BGCE] Client buffer: %p size=%zu (%dx%d) buffers=%u fd=%d\n",
+		       client->buffer,
+		       client->map_size,
+		       client->width, client->height,
+		       client->buffer_count,
+		       client->fd);
+
+		reply.status = 0;
+		reply.width = client->width;
+		reply.height = client->height;
+		reply.stride = client->stride;
+		reply.buffers = client->buffer_count;
+		msg->data.buffer_reply = reply;
+		client_send(client, msg->type, msg->serial, &msg->data.buffer_reply, sizeof(reply), &buf_fd, 1);
+		close(buf_fd);
+		break;
+	}
+
+	case MSG_DRAW: {
+		printf("[BGCE] Received draw event from client fd=%d\n", client->fd);
+		// Covered parts are clipped, so any client may draw
+		draw(&server, client);
+		break;
+	}
+	case MSG_DRAW_RECTS: {
+		struct DrawRects* d = &msg->data.draw_rects;
+		size_t count = d->count < BGCE_MAX_DRAW_RECTS ? d->count : BGCE_MAX_DRAW_RECTS;
+		draw_rects(&server, client, d->rects, count);
+		break;
+	}
+	case MSG_MOVE: {
+		struct MoveRequest move_req = msg->data.move_request;
+		printf(
+			"[BGCE] Client requested move to position (%d, %d)\n",
+			move_req.x, move_req.y);
+
+		// Update client position
+		move_client(&server, client, move_req.x, move_req.y);
+		schedule_frame(&server);
+
+		break;
+	}
+	case MSG_SUBMIT:
+		submit_buffer(client, msg->data.buffer_index.index);
+		break;
+	case MSG_FRAME:
+		// Called back once the next draw or submit is on screen
+		client->frame_requested = 1;
+		break;
+	case MSG_SETUP_RING:
+		setup_ring(client, msg->serial);
+		break;
+	case MSG_GET_LATENCY:
+		latency_report(&msg->data.latency_report);
+		client_send_msg(client, msg);
+		break;
+	default:
+		fprintf(stderr, "[BGCE] Unknown message type %d\n", msg->type);
+	}
+}
+
+/* Apply the requests packed in a transaction, all in the same frame */
+static void apply_transaction(struct Client* client, const uint8_t* buf, size_t len) {
+	hold_frames(&server);
+	size_t off = 0;
+	while (off < len) {
+		struct BGCEMessage msg;
+		ssize_t used = bgce_parse_msg(buf + off, len - off, &msg);
+		if (used <= 0) {
+			fprintf(stderr, "[BGCE] Client fd=%d sent a broken transaction\n", client->fd);
+			break;
+		}
+		off += used;
+
+		switch (msg.type) {
+		case MSG_DRAW:
+		case MSG_DRAW_RECTS:
+		case MSG_MOVE:
+		case MSG_SUBMIT:
+		case MSG_FRAME:
+			handle_message(client, &msg);
+			break;
+		default:
+			fprintf(stderr, "[BGCE] Message type %u not allowed in a transaction\n", msg.type);
+		}
+	}
+	release_frames(&server);
+}
+
+/* Read what the client sent, without blocking, and handle whole messages */
+static void client_ready(struct Watch* w, uint32_t events) {
+	struct Client* client = w->data;
+
+	if (events & EPOLLOUT)
+		flush_client(client);
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+
+	ssize_t n = 0;
+	if (events & EPOLLIN) {
+		n = recv(client->fd, client->in + client->in_len,
+		         sizeof(client->in) - client->in_len, MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+	}
+	if (n <= 0) {
+		remove_client(client);
+		return;
+	}
+	client->in_len += n;
+
+	size_t off = 0;
+	while (off < client->in_len) {
+		struct BGCEMessage msg;
+		ssize_t used = bgce_parse_msg(client->in + off, client->in_len - off, &msg);
+		if (used < 0) {
+			remove_client(client);
+			return;
+		}
+		if (used == 0)
+			break;
+
+		// Ring commands issued before this message go first
+		drain_ring(client);
+		client->received++;
+		if (msg.type == MSG_TRANSACTION)
+			apply_transaction(client, client->in + off + sizeof(struct BGCEHeader),
+			                  used - sizeof(struct BGCEHeader));
+		else
+			handle_message(client, &msg);
+		off += used;
+	}
+
+	client->in_len -= off;
+	memmove(client->in, client->in + off, client->in_len);
+
+	// Then those issued after them, which waited for them
+	drain_ring(client);
+}
+
+static void accept_ready(struct Watch* w, uint32_t events) {
+	(void)events;
+
+	int client_fd = accept(w->fd, NULL, NULL);
+	if (client_fd < 0) {
+		perror("accept");
+		return;
+	}
+	fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+
+	printf("[BGCE] Client connected (fd=%d)\n", client_fd);
+
+	// Allocate memory for the client
+	struct Client* client = calloc(1, sizeof(struct Client));
+	if (!client) {
+		perror("Failed to allocate memory for client");
+		close(client_fd);
+		return;
+	}
+
+	client->fd = client_fd;
+	client->watch.fd = client_fd;
+	client->watch.ready = client_ready;
+	client->watch.data = client;
+	client->out_tail = &client->out_head;
+	if (watch_fd(&client->watch, EPOLLIN) < 0) {
+		close(client_fd);
+		free(client);
+		return;
+	}
+
+	// Add client to the linked list
+	pthread_mutex_lock(&server.lock);
+	client->next = server.clients;
+	client->z = server.clients->z + 1;
+	server.clients = client;
+	pthread_mutex_unlock(&server.lock);
+	server.focused_client = client; /* last connected client gets focus */
+
+	printf("[BGCE] Client fd=%d z=%d\n", client_fd, client->z);
+}
+
+static struct Watch listen_watch;
+
+int watch_clients(int listen_fd) {
+	listen_watch.fd = listen_fd;
+	listen_watch.ready = accept_ready;
+	return watch_fd(&listen_watch, EPOLLIN);
 }
@@ -0,0 +1,216 @@
+#include "server.h"
+
+#include <errno.h>
+#include <linux/input.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Messages to clients never block the event loop. They go out right
+ * away when the socket has room, otherwise they wait in the client's
+ * queue until it is writable again. Replies and notifications are
+ * always kept, there is one per request of the client. Input events
+ * are not asked for: motion is merged into the motion already waiting
+ * and, past CLIENT_QUEUE_MAX messages, events are dropped, so a client
+ * that stops reading only loses its own input.
+ */
+
+#define CLIENT_QUEUE_MAX 64
+
+struct OutMsg {
+	struct OutMsg* next;
+	size_t len;
+	size_t sent;
+	int fds[BGCE_MAX_FDS]; /* our own copies, sent with the first byte */
+	int nfds;
+	uint8_t data[]; /* header and payload */
+};
+
+/* Write what the socket takes, returns the bytes sent or -1 */
+static ssize_t send_some(int fd, const uint8_t* data, size_t len, const int* fds, int nfds) {
+	struct iovec iov = {.iov_base = (void*)data, .iov_len = len};
+	struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * BGCE_MAX_FDS)];
+	} ctrl;
+	if (nfds > 0) {
+		memset(&ctrl, 0, sizeof(ctrl));
+		mh.msg_control = ctrl.buf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+	}
+
+	ssize_t n;
+	do {
+		n = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("[BGCE] send to client");
+	return n;
+}
+
+static void free_msg(struct OutMsg* m) {
+	for (int i = 0; i < m->nfds; i++)
+		close(m->fds[i]);
+	free(m);
+}
+
+static void want_writable(struct Client* c, int on) {
+	if (c->writable_watched == on || c->watch.fd < 0)
+		return;
+	c->writable_watched = on;
+	rewatch_fd(&c->watch, on ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+static void append(struct Client* c, struct OutMsg* m) {
+	m->next = NULL;
+	*c->out_tail = m;
+	c->out_tail = &m->next;
+	c->out_count++;
+	want_writable(c, 1);
+}
+
+static int input_motion(const struct OutMsg* m, struct InputEvent* ev) {
+	struct BGCEHeader hdr;
+	memcpy(&hdr, m->data, sizeof(hdr));
+	if (hdr.type != MSG_INPUT_EVENT || hdr.length != sizeof(*ev))
+		return 0;
+	memcpy(ev, m->data + sizeof(hdr), sizeof(*ev));
+	return ev->type == EV_REL;
+}
+
+/*
+ * Add ev to the motion along the same axis still waiting, when only
+ * other motion follows it, so events keep their order otherwise.
+ */
+static int merge_motion(struct Client* c, const struct InputEvent* ev) {
+	struct OutMsg* found = NULL;
+	struct InputEvent queued;
+	for (struct OutMsg* m = c->out_head; m; m = m->next) {
+		if (m->sent || !input_motion(m, &queued)) {
+			found = NULL;
+			continue;
+		}
+		if (queued.device == ev->device && queued.code == ev->code)
+			found = m;
+	}
+	if (!found)
+		return 0;
+
+	input_motion(found, &queued);
+	queued.value += ev->value;
+	queued.x = ev->x;
+	queued.y = ev->y; /* time_ns stays the one of the first */
+	memcpy(found->data + sizeof(struct BGCEHeader), &queued, sizeof(queued));
+	return 1;
+}
+
+int client_send(struct Client* c, uint32_t type, uint32_t serial, const void* payload, size_t length,
+                const int* fds, int nfds) {
+	struct BGCEHeader hdr = {
+	        .version = BGCE_PROTOCOL_VERSION,
+	        .type = type,
+	        .length = length,
+	        .serial = serial,
+	        .fds = nfds,
+	};
+	size_t len = sizeof(hdr) + length;
+
+	if (type == MSG_INPUT_EVENT && c->out_head) {
+		const struct InputEvent* ev = payload;
+		if (ev->type == EV_REL && merge_motion(c, ev))
+			return 0;
+		if (c->out_count >= CLIENT_QUEUE_MAX) {
+			if (!c->dropping)
+				fprintf(stderr, "[BGCE] Client fd=%d is not reading, dropping its input\n", c->fd);
+			c->dropping = 1;
+			return -1;
+		}
+	}
+
+	struct OutMsg* m = malloc(sizeof(struct OutMsg) + len);
+	if (!m) {
+		perror("[BGCE] queue message");
+		return -1;
+	}
+	m->len = len;
+	m->sent = 0;
+	m->nfds = 0;
+	memcpy(m->data, &hdr, sizeof(hdr));
+	if (length)
+		memcpy(m->data + sizeof(hdr), payload, length);
+
+	/* Nothing waiting, try to skip the queue */
+	if (!c->out_head) {
+		ssize_t n = send_some(c->fd, m->data, len, fds, nfds);
+		if (n == (ssize_t)len) {
+			free(m);
+			return 0;
+		}
+		if (n > 0) {
+			m->sent = n; /* the fds went along */
+			nfds = 0;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			free(m);
+			return -1; /* gone, reading will tell */
+		}
+	}
+
+	/* The caller closes its fds once this returns */
+	for (int i = 0; i < nfds && i < BGCE_MAX_FDS; i++) {
+		m->fds[i] = dup(fds[i]);
+		if (m->fds[i] < 0) {
+			perror("[BGCE] dup");
+			free_msg(m);
+			return -1;
+		}
+		m->nfds++;
+	}
+	append(c, m);
+	return 0;
+}
+
+int client_send_msg(struct Client* c, struct BGCEMessage* msg) {
+	return client_send(c, msg->type, msg->serial, &msg->data, bgce_payload_size(msg), NULL, 0);
+}
+
+void flush_client(struct Client* c) {
+	while (c->out_head) {
+		struct OutMsg* m = c->out_head;
+		ssize_t n = send_some(c->fd, m->data + m->sent, m->len - m->sent,
+		                      m->sent ? NULL : m->fds, m->sent ? 0 : m->nfds);
+		if (n <= 0)
+			return; /* still full, or gone and about to be removed */
+		m->sent += n;
+		if (m->sent < m->len)
+			return;
+
+		c->out_head = m->next;
+		if (!c->out_head)
+			c->out_tail = &c->out_head;
+		c->out_count--;
+		free_msg(m);
+	}
+	c->dropping = 0;
+	want_writable(c, 0);
+}
+
+void release_queue(struct Client* c) {
+	while (c->out_head) {
+		struct OutMsg* m = c->out_head;
+		c->out_head = m->next;
+		free_msg(m);
+	}
+	c->out_tail = &c->out_head;
+	c->out_count = 0;
+}
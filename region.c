@@ -0,0 +1,250 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Regions are kept as a list of non-overlapping rectangles, every
+ * operation below preserves that invariant. Rectangles are half-open:
+ * (x1, y1) is inside, (x2, y2) is not.
+ *
+ * The algorithms are the simple quadratic ones, window counts are
+ * small and the lists stay short.
+ */
+
+static int rect_empty(struct Rect r) {
+	return r.x1 >= r.x2 || r.y1 >= r.y2;
+}
+
+static int rect_overlaps(struct Rect a, struct Rect b) {
+	return a.x1 < b.x2 && b.x1 < a.x2 && a.y1 < b.y2 && b.y1 < a.y2;
+}
+
+static int rect_contains(struct Rect a, struct Rect b) {
+	return a.x1 <= b.x1 && a.y1 <= b.y1 && a.x2 >= b.x2 && a.y2 >= b.y2;
+}
+
+struct Rect rect_intersect(struct Rect a, struct Rect b) {
+	struct Rect r = {
+	        .x1 = a.x1 > b.x1 ? a.x1 : b.x1,
+	        .y1 = a.y1 > b.y1 ? a.y1 : b.y1,
+	        .x2 = a.x2 < b.x2 ? a.x2 : b.x2,
+	        .y2 = a.y2 < b.y2 ? a.y2 : b.y2,
+	};
+	if (rect_empty(r)) {
+		memset(&r, 0, sizeof(r));
+	}
+	return r;
+}
+
+static int region_reserve(struct Region* r, size_t count) {
+	if (count <= r->cap) {
+		return 0;
+	}
+
+	size_t cap = r->cap ? r->cap * 2 : 8;
+	while (cap < count)
+		cap *= 2;
+
+	struct Rect* rects = realloc(r->rects, cap * sizeof(struct Rect));
+	if (!rects) {
+		perror("[BGCE] region realloc");
+		return -1;
+	}
+	r->rects = rects;
+	r->cap = cap;
+	return 0;
+}
+
+static int region_append(struct Region* r, struct Rect rect) {
+	if (rect_empty(rect)) {
+		return 0;
+	}
+	if (region_reserve(r, r->count + 1) < 0) {
+		return -1;
+	}
+	r->rects[r->count++] = rect;
+	return 0;
+}
+
+void region_init(struct Region* r) {
+	r->rects = NULL;
+	r->count = 0;
+	r->cap = 0;
+}
+
+void region_fini(struct Region* r) {
+	free(r->rects);
+	region_init(r);
+}
+
+void region_clear(struct Region* r) {
+	r->count = 0;
+}
+
+int region_empty(const struct Region* r) {
+	return r->count == 0;
+}
+
+int region_copy(struct Region* dst, const struct Region* src) {
+	if (dst == src) {
+		return 0;
+	}
+	if (region_reserve(dst, src->count) < 0) {
+		return -1;
+	}
+	memcpy(dst->rects, src->rects, src->count * sizeof(struct Rect));
+	dst->count = src->count;
+	return 0;
+}
+
+struct Rect region_extents(const struct Region* r) {
+	struct Rect ext = {0};
+	for (size_t i = 0; i < r->count; i++) {
+		struct Rect a = r->rects[i];
+		if (i == 0) {
+			ext = a;
+			continue;
+		}
+		if (a.x1 < ext.x1)
+			ext.x1 = a.x1;
+		if (a.y1 < ext.y1)
+			ext.y1 = a.y1;
+		if (a.x2 > ext.x2)
+			ext.x2 = a.x2;
+		if (a.y2 > ext.y2)
+			ext.y2 = a.y2;
+	}
+	return ext;
+}
+
+/*
+ * Cutting rect s out of rect a leaves at most four pieces:
+ *
+ *   +-----------------+
+ *   |       top       |
+ *   +-----+-----+-----+
+ *   |left |  s  |right|
+ *   +-----+-----+-----+
+ *   |     bottom      |
+ *   +-----------------+
+ */
+int region_subtract_rect(struct Region* r, struct Rect s) {
+	if (rect_empty(s)) {
+		return 0;
+	}
+
+	size_t n = r->count;
+	for (size_t i = 0; i < n;) {
+		struct Rect a = r->rects[i];
+		if (!rect_overlaps(a, s)) {
+			i++;
+			continue;
+		}
+
+		/* Drop a by moving the last old rect into its slot, the
+		 * pieces are appended after the old rects so they are not
+		 * visited again. */
+		r->rects[i] = r->rects[n - 1];
+		r->rects[n - 1] = r->rects[r->count - 1];
+		r->count--;
+		n--;
+
+		int mid_y1 = a.y1 > s.y1 ? a.y1 : s.y1;
+		int mid_y2 = a.y2 < s.y2 ? a.y2 : s.y2;
+		struct Rect pieces[4] = {
+		        {a.x1, a.y1, a.x2, s.y1},
+		        {a.x1, s.y2, a.x2, a.y2},
+		        {a.x1, mid_y1, s.x1, mid_y2},
+		        {s.x2, mid_y1, a.x2, mid_y2},
+		};
+		for (int p = 0; p < 4; p++) {
+			struct Rect c = rect_intersect(pieces[p], a);
+			if (region_append(r, c) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int region_subtract(struct Region* dst, const struct Region* src) {
+	for (size_t i = 0; i < src->count && dst->count; i++) {
+		if (region_subtract_rect(dst, src->rects[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int region_union_rect(struct Region* r, struct Rect s) {
+	if (rect_empty(s)) {
+		return 0;
+	}
+
+	/* Only add the parts of s not already covered */
+	struct Region add;
+	region_init(&add);
+	if (region_append(&add, s) < 0) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < r->count && add.count; i++) {
+		if (rect_contains(r->rects[i], s)) {
+			region_fini(&add);
+			return 0;
+		}
+		if (region_subtract_rect(&add, r->rects[i]) < 0) {
+			region_fini(&add);
+			return -1;
+		}
+	}
+
+	int rc = 0;
+	for (size_t i = 0; i < add.count && rc == 0; i++) {
+		rc = region_append(r, add.rects[i]);
+	}
+	region_fini(&add);
+	return rc;
+}
+
+int region_union(struct Region* dst, const struct Region* src) {
+	for (size_t i = 0; i < src->count; i++) {
+		if (region_union_rect(dst, src->rects[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int region_intersect_rect(struct Region* r, struct Rect s) {
+	size_t out = 0;
+	for (size_t i = 0; i < r->count; i++) {
+		struct Rect c = rect_intersect(r->rects[i], s);
+		if (!rect_empty(c)) {
+			r->rects[out++] = c;
+		}
+	}
+	r->count = out;
+	return 0;
+}
+
+int region_intersect(struct Region* dst, const struct Region* src) {
+	/* Both lists are disjoint so the pairwise pieces are too */
+	struct Region res;
+	region_init(&res);
+	for (size_t i = 0; i < src->count; i++) {
+		for (size_t j = 0; j < dst->count; j++) {
+			struct Rect c = rect_intersect(src->rects[i], dst->rects[j]);
+			if (region_append(&res, c) < 0) {
+				region_fini(&res);
+				return -1;
+			}
+		}
+	}
+
+	free(dst->rects);
+	*dst = res;
+	return 0;
+}
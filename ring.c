@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Server side of the command rings, see struct BGCERing. The event
+ * loop drains every ring each time it wakes up, up to the first
+ * command issued after a socket message it has not handled yet; that
+ * message waking the loop lets it through. Before going to sleep
+ * it marks the rings sleeping, so clients ring the doorbell, unless a
+ * page flip is in flight: its completion wakes the loop within a
+ * refresh anyway, and clients get away without any system call.
+ */
+
+extern struct ServerState server;
+
+/* Whether cmd has to wait for socket messages sent before it */
+static int behind_socket(const struct Client* c, const struct BGCECommand* cmd) {
+	return (int32_t)(cmd->sent - c->received) > 0;
+}
+
+int drain_ring(struct Client* c) {
+	struct BGCERing* ring = c->ring;
+	if (!ring)
+		return 0;
+
+	uint32_t tail = ring->tail;
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (head - tail > BGCE_RING_ENTRIES) {
+		fprintf(stderr, "[BGCE] Client fd=%d corrupted its ring\n", c->fd);
+		tail = head;
+	}
+
+	int waiting = 0;
+	while (tail != head) {
+		/* Copy first, the client may scribble over shared memory */
+		struct BGCECommand cmd = ring->cmds[tail & (BGCE_RING_ENTRIES - 1)];
+		if (behind_socket(c, &cmd)) {
+			waiting = 1;
+			break;
+		}
+		tail++;
+
+		struct BGCEMessage msg = {.type = cmd.type};
+		if (cmd.type == MSG_DRAW_RECTS) {
+			/* One commit for a run of rects, like a socket message */
+			struct DrawRects* d = &msg.data.draw_rects;
+			d->rects[d->count++] = cmd.data.rect;
+			while (tail != head && d->count < BGCE_MAX_DRAW_RECTS) {
+				struct BGCECommand* next = &ring->cmds[tail & (BGCE_RING_ENTRIES - 1)];
+				if (next->type != MSG_DRAW_RECTS || behind_socket(c, next))
+					break;
+				d->rects[d->count++] = next->data.rect;
+				tail++;
+			}
+		} else if (cmd.type == MSG_MOVE)
+			msg.data.move_request = cmd.data.move_request;
+		else if (cmd.type == MSG_SUBMIT)
+			msg.data.buffer_index = cmd.data.buffer_index;
+		else if (cmd.type != MSG_DRAW && cmd.type != MSG_FRAME)
+			continue;
+		handle_message(c, &msg);
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	return waiting;
+}
+
+static void doorbell_ready(struct Watch* w, uint32_t events) {
+	(void)events;
+	uint64_t rings;
+	if (read(w->fd, &rings, sizeof(rings)) < 0 && errno != EAGAIN)
+		perror("[BGCE] read doorbell");
+	drain_ring(w->data);
+}
+
+int setup_ring(struct Client* c, uint32_t serial) {
+	if (c->ring) {
+		return client_send(c, MSG_SETUP_RING, serial, NULL, 0, NULL, 0);
+	}
+
+	int mem_fd = memfd_create("bgce-ring", MFD_CLOEXEC);
+	if (mem_fd < 0) {
+		perror("[BGCE] memfd_create");
+		goto fail;
+	}
+	if (ftruncate(mem_fd, sizeof(struct BGCERing)) < 0) {
+		perror("[BGCE] ftruncate ring");
+		close(mem_fd);
+		goto fail;
+	}
+
+	void* map = mmap(NULL, sizeof(struct BGCERing), PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+	if (map == MAP_FAILED) {
+		perror("[BGCE] mmap ring");
+		close(mem_fd);
+		goto fail;
+	}
+
+	int bell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (bell_fd < 0) {
+		perror("[BGCE] eventfd");
+		munmap(map, sizeof(struct BGCERing));
+		close(mem_fd);
+		goto fail;
+	}
+
+	c->doorbell.fd = bell_fd;
+	c->doorbell.ready = doorbell_ready;
+	c->doorbell.data = c;
+	if (watch_fd(&c->doorbell, EPOLLIN) < 0) {
+		close(bell_fd);
+		munmap(map, sizeof(struct BGCERing));
+		close(mem_fd);
+		goto fail;
+	}
+	c->ring = map;
+	c->received = 0;
+
+	int fds[2] = {mem_fd, bell_fd};
+	client_send(c, MSG_SETUP_RING, serial, NULL, 0, fds, 2);
+	close(mem_fd);
+	printf("[BGCE] Command ring set up for client fd=%d\n", c->fd);
+	return 0;
+
+fail:
+	/* No fds attached, the client keeps using the socket */
+	client_send(c, MSG_SETUP_RING, serial, NULL, 0, NULL, 0);
+	return -1;
+}
+
+void release_ring(struct Client* c) {
+	if (!c->ring)
+		return;
+
+	int fd = c->doorbell.fd;
+	unwatch_fd(&c->doorbell);
+	close(fd);
+	munmap(c->ring, sizeof(struct BGCERing));
+	c->ring = NULL;
+}
+
+/* Whether something already wakes the loop within a refresh */
+static int wakeup_coming(void) {
+	pthread_mutex_lock(&server.lock);
+	int flipping = server.pending >= 0;
+	pthread_mutex_unlock(&server.lock);
+	return flipping;
+}
+
+void park_rings(void) {
+	int awake = wakeup_coming();
+
+	for (struct Client* c = server.clients; c; c = c->next) {
+		struct BGCERing* ring = c->ring;
+		if (!ring)
+			continue;
+
+		int waiting = drain_ring(c);
+		if (awake)
+			continue;
+
+		/* Pairs with the client publishing head, then looking at
+		 * sleeping: either it sees the flag or we see its command.
+		 * Commands waiting for the socket are let through once it
+		 * is read. */
+		while (1) {
+			__atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (waiting || __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail)
+				break;
+			__atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+			waiting = drain_ring(c);
+		}
+	}
+}
+
+void unpark_rings(void) {
+	for (struct Client* c = server.clients; c; c = c->next) {
+		if (c->ring)
+			__atomic_store_n(&c->ring->sleeping, 0, __ATOMIC_RELAXED);
+	}
+}
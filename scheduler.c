@@ -0,0 +1,179 @@
+#include "server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Frame scheduler: instead of compositing on every request, threads
+ * add damage and call schedule_frame(). A single compositor thread
+ * then paints everything that piled up at the next frame deadline, at
+ * most once per refresh. An idle screen composites right away, so the
+ * wait is never longer than one refresh.
+ *
+ * Frames are shown on whichever thread completes them, but only the
+ * event loop writes to clients, so an eventfd wakes it to send the
+ * frame callbacks.
+ */
+
+static pthread_t compositor_thread;
+static int quit;
+static struct Watch presented_watch = {.fd = -1};
+
+static long refresh_interval(const struct ServerState* srv) {
+	return 1000000000L / (srv->refresh ? srv->refresh : 60);
+}
+
+static int before(const struct timespec* a, const struct timespec* b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void add_ns(struct timespec* t, long ns) {
+	t->tv_nsec += ns;
+	while (t->tv_nsec >= 1000000000L) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+}
+
+static void* compositor_loop(void* arg) {
+	struct ServerState* srv = arg;
+	long interval = refresh_interval(srv);
+
+	pthread_mutex_lock(&srv->lock);
+	while (!quit) {
+		while (!quit && (!srv->frame_requested || srv->frames_held))
+			pthread_cond_wait(&srv->frame_cond, &srv->lock);
+
+		/* Wait for the deadline, collecting whatever else comes in */
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while (!quit && before(&now, &srv->next_frame)) {
+			pthread_cond_timedwait(&srv->frame_cond, &srv->lock, &srv->next_frame);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		}
+		if (quit)
+			break;
+		if (srv->frames_held)
+			continue;
+
+		/* Keep the cadence while busy, restart it after being idle */
+		struct timespec late = srv->next_frame;
+		add_ns(&late, interval);
+		if (!before(&now, &late))
+			srv->next_frame = now;
+		add_ns(&srv->next_frame, interval);
+		srv->frame_requested = 0;
+
+		pthread_mutex_unlock(&srv->lock);
+		composite_damage(srv);
+		pthread_mutex_lock(&srv->lock);
+	}
+	pthread_mutex_unlock(&srv->lock);
+	return NULL;
+}
+
+/* Send MSG_FRAME_DONE to the clients whose frame is on screen */
+static void frames_presented(struct Watch* w, uint32_t events) {
+	(void)events;
+	struct ServerState* srv = w->data;
+	uint64_t count;
+	if (read(w->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("[BGCE] read presented");
+
+	struct FrameDone done = {.refresh_ns = refresh_interval(srv)};
+	pthread_mutex_lock(&srv->lock);
+	done.frame = srv->shown;
+	done.time_ns = srv->presented_at.tv_sec * 1000000000ULL + srv->presented_at.tv_nsec;
+	for (struct Client* c = srv->clients; c; c = c->next) {
+		c->frame_sending = c->frame_due;
+		c->frame_due = 0;
+	}
+	pthread_mutex_unlock(&srv->lock);
+
+	/* Only this thread changes the client list */
+	for (struct Client* c = srv->clients; c; c = c->next) {
+		if (!c->frame_sending)
+			continue;
+		c->frame_sending = 0;
+		struct BGCEMessage msg = {.type = MSG_FRAME_DONE};
+		msg.data.frame_done = done;
+		client_send_msg(c, &msg);
+	}
+}
+
+void wake_frame_callbacks(struct ServerState* srv) {
+	(void)srv;
+	uint64_t one = 1;
+	if (presented_watch.fd >= 0 && write(presented_watch.fd, &one, sizeof(one)) < 0)
+		perror("[BGCE] write presented");
+}
+
+int start_compositor(struct ServerState* srv) {
+	presented_watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	presented_watch.ready = frames_presented;
+	presented_watch.data = srv;
+	if (presented_watch.fd < 0) {
+		perror("[BGCE] eventfd");
+		return -1;
+	}
+	if (watch_fd(&presented_watch, EPOLLIN) < 0) {
+		close(presented_watch.fd);
+		presented_watch.fd = -1;
+		return -1;
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&srv->frame_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	int rc = pthread_create(&compositor_thread, NULL, compositor_loop, srv);
+	if (rc != 0) {
+		errno = rc;
+		perror("[BGCE] Failed to start compositor thread");
+		return -1;
+	}
+	printf("[BGCE] Compositing at most %u times a second\n", srv->refresh);
+	return 0;
+}
+
+void stop_compositor(struct ServerState* srv) {
+	pthread_mutex_lock(&srv->lock);
+	quit = 1;
+	pthread_cond_signal(&srv->frame_cond);
+	pthread_mutex_unlock(&srv->lock);
+
+	pthread_join(compositor_thread, NULL);
+
+	int fd = presented_watch.fd;
+	unwatch_fd(&presented_watch);
+	close(fd);
+}
+
+void hold_frames(struct ServerState* srv) {
+	pthread_mutex_lock(&srv->lock);
+	srv->frames_held++;
+	pthread_mutex_unlock(&srv->lock);
+}
+
+void release_frames(struct ServerState* srv) {
+	pthread_mutex_lock(&srv->lock);
+	if (--srv->frames_held == 0 && srv->frame_requested)
+		pthread_cond_signal(&srv->frame_cond);
+	pthread_mutex_unlock(&srv->lock);
+}
+
+void schedule_frame(struct ServerState* srv) {
+	pthread_mutex_lock(&srv->lock);
+	if (!srv->frame_requested) {
+		srv->frame_requested = 1;
+		pthread_cond_signal(&srv->frame_cond);
+	}
+	pthread_mutex_unlock(&srv->lock);
+}
@@ -7,12 +7,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 struct ServerState server = {}; /* Global server state */
 
+static void display_ready(struct Watch* w, uint32_t events) {
+	(void)w;
+	(void)events;
+	display_dispatch(&server);
+}
+
 int main(void) {
 	setvbuf(stdout, NULL, _IONBF, 0); // Disable buffering for stdout
 	setvbuf(stderr, NULL, _IONBF, 0); // Disable buffering for stderr
@@ -22,16 +29,17 @@ int main(void) {
 	server.framebuffer = NULL;
 	server.crtc_id = 0;
 	server.client_count = 0;
+	region_init(&server.damage);
+	pthread_mutex_init(&server.lock, NULL);
+
+	init_blit();
 
 	struct config config;
-	char* home = getenv("HOME");
-	if (home) {
-		char user_config[512];
-		snprintf(user_config, sizeof(user_config), "%s/.config/bgce.conf", home);
-		parse_config(&config);
-	}
+	parse_config(&config); // falls back to defaults without a config file
 	printf("[BGCE] Loaded config type=%u, path=%s, mode=%u\n", config.type, config.path, config.mode);
 
+	init_workers(config.workers);
+
 	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (fd < 0) {
 		perror("socket");
@@ -58,20 +66,37 @@ int main(void) {
 
 	server.server_fd = fd;
 
-	if (init_display() != 0) {
+	if (init_loop() != 0) {
+		close(fd);
+		return 1;
+	}
+
+	if (init_display(&config) != 0) {
 		fprintf(stderr, "display init failed\n");
 		release_display();
 		return 1;
 	}
 	printf("[BGCE] Display initialised\n");
 
+	if (init_grid(server.display_w, server.display_h) != 0) {
+		release_display();
+		return 1;
+	}
+
+	if (start_compositor(&server) != 0) {
+		release_display();
+		return 1;
+	}
+
 	/* Add a background client */
-	struct Client background_client;
+	struct Client background_client = {0};
 	background_client.x = 0;
 	background_client.y = 0;
 	background_client.z = 0; // Special case
+	background_client.flags = BGCE_BUFFER_OPAQUE;
 	background_client.width = server.display_w;
 	background_client.height = server.display_h;
+	background_client.stride = server.display_w * BGCE_BYTES_PER_PIXEL;
 	background_client.buffer = malloc(server.display_w * server.display_h * 4);
 	background_client.next = NULL;
 	server.clients = &background_client;
@@ -80,53 +105,36 @@ int main(void) {
 	apply_background(&config, background_client.buffer, server.display_w, server.display_h);
 
 	puts("[BGCE] Drawing background");
-	draw(&server, background_client);
-
-	if (init_input() != 0) {
-		perror("[BGCE] Failed to start input thread");
+	update_visibility(&server);
+	draw(&server, &background_client);
+
+	/* Headless machines usually have no input devices, that is fine */
+	if (init_input() == 0) {
+		printf("[BGCE] Input initialised\n");
+	} else if (server.backend != &headless_backend) {
+		fprintf(stderr, "[BGCE] Failed to initialise input\n");
 		return 4;
+	} else {
+		printf("[BGCE] Running without input devices\n");
 	}
-	pthread_t input_thread;
 
-	int rc = pthread_create(&input_thread, NULL, input_loop, NULL);
-	if (rc != 0) {
-		errno = rc;
-		perror("[BGCE] Failed to start input thread");
-		return 5;
+	/* Page flip completions, or the headless vblank timer */
+	struct Watch display_watch = {.fd = display_event_fd()};
+	display_watch.ready = display_ready;
+	if (display_watch.fd >= 0 && watch_fd(&display_watch, EPOLLIN) < 0) {
+		return 1;
 	}
-	pthread_detach(input_thread);
 
+	if (watch_clients(fd) < 0) {
+		return 1;
+	}
 	printf("[BGCE] Server listening on %s\n", SOCKET_PATH);
 
-	while (1) {
-		int client_fd = accept(fd, NULL, NULL);
-		if (client_fd < 0) {
-			perror("accept");
-			continue;
-		}
-
-		printf("[BGCE] Client connected (fd=%d)\n", client_fd);
-
-		pthread_t tid;
-		int* arg = malloc(sizeof(int));
-		if (!arg) {
-			perror("malloc");
-			close(client_fd);
-			continue;
-		}
-
-		*arg = client_fd;
-		if (pthread_create(&tid, NULL, client_thread, arg) != 0) {
-			perror("pthread_create input thread");
-			free(arg);
-			close(client_fd);
-			continue;
-		}
-
-		pthread_detach(tid);
-	}
+	run_loop();
 
+	stop_compositor(&server);
 	release_display();
+	release_workers();
 	free(server.framebuffer);
 
 	return 0;
@@ -4,14 +4,48 @@
 #define _XOPEN_SOURCE 700
 #include "bgce.h"
 
-#include <drm/drm_mode.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <sys/types.h>
-#include <xf86drmMode.h>
+#include <time.h>
 
 #define MAX_PATH_LEN 512
 
+/* Rows of client buffers start on a cache line */
+#define STRIDE_ALIGN 64
+#define ALIGN_STRIDE(width) \
+	(((size_t)(width) * BGCE_BYTES_PER_PIXEL + STRIDE_ALIGN - 1) & ~(size_t)(STRIDE_ALIGN - 1))
+
+/* ----------------------------
+ * Regions
+ * ---------------------------- */
+
+/* Half-open rectangle: x1,y1 inclusive, x2,y2 exclusive */
+struct Rect {
+	int32_t x1;
+	int32_t y1;
+	int32_t x2;
+	int32_t y2;
+};
+
+/* A set of pixels as a list of non-overlapping rectangles */
+struct Region {
+	struct Rect* rects;
+	size_t count;
+	size_t cap;
+};
+
+/* ----------------------------
+ * Event loop
+ * ---------------------------- */
+
+/* An fd the event loop waits on and what to do when it is ready */
+struct Watch {
+	int fd; /* -1 once unwatched */
+	void (*ready)(struct Watch* w, uint32_t events);
+	void* data;
+};
+
 /* ----------------------------
  * Client Representation
  * ---------------------------- */
@@ -19,25 +53,75 @@
 struct Client {
 	int fd;
 	pid_t pid;
-	char shm_name[64];
-	void* buffer;
+	void* buffer; /* the one shown, inside map */
 	uint32_t width;
 	uint32_t height;
-	uint32_t x;
-	uint32_t y;
+	uint32_t stride; /* bytes from one row of the buffer to the next */
+	int32_t x;
+	int32_t y;
 	uint32_t z;
+	uint32_t flags;        /* BGCE_BUFFER_* */
+	struct Region visible; /* on-screen part not covered by opaque windows above */
+	struct Rect grid;      /* cells of the hit-test grid it is listed in, inclusive */
+	int gridded;
 	struct Client* next;
-	int inputs[MAX_INPUT_DEVICES];
+
+	/* Shared memory of the buffers, a swapchain when buffer_count > 1 */
+	void* map;
+	size_t map_size;
+	uint32_t buffer_count;
+	uint32_t current; /* index of buffer */
+	struct BGCESwapchainState* swapchain;
+
+	/* Frame callbacks: the next commit after a MSG_FRAME sets the
+	 * composition to wait for, the flip showing it makes the callback
+	 * due, written under the server lock */
+	int frame_requested;
+	uint64_t frame_target; /* 0 for none */
+	int frame_due;         /* shown, MSG_FRAME_DONE to send */
+	int frame_sending;     /* taken from frame_due, event loop only */
+
+	struct Watch watch;
+	uint8_t in[BGCE_MAX_MSG_SIZE]; /* bytes of a message not complete yet */
+	size_t in_len;
+
+	struct BGCERing* ring; /* commands shared with the client, or NULL */
+	struct Watch doorbell;
+	uint32_t received; /* socket messages since the ring was set up */
+
+	/* Messages the socket had no room for yet, see queue.c */
+	struct OutMsg* out_head;
+	struct OutMsg** out_tail;
+	size_t out_count;
+	int writable_watched; /* EPOLLOUT in the watch */
+	int dropping;         /* input dropped since the queue last emptied */
+
+	/* Time of the oldest input sent since its last commit, 0 for none */
+	uint64_t input_ns;
 };
 
 /* ----------------------------
  * Server State
  * ---------------------------- */
 
-struct InputState {
-	int fds[MAX_INPUT_DEVICES];
-	struct InputDevice devs[MAX_INPUT_DEVICES];
-	size_t count;
+#define MAX_SCANOUT_BUFFERS 3
+
+struct ScanoutBuffer {
+	void* map;
+	uint64_t size;
+	uint32_t pitch;
+	uint32_t handle;
+	uint32_t fb_id;
+
+	/* Rows changed in the shadow since this buffer was composed */
+	uint8_t* stale_rows;
+	uint32_t stale_y1;
+	uint32_t stale_y2;
+	uint32_t stale_x1; /* columns changed on any of the rows */
+	uint32_t stale_x2;
+
+	uint64_t frame;    /* when it was last queued for scanout, its age */
+	uint64_t composed; /* last composition copied in */
 };
 
 struct ServerState {
@@ -47,9 +131,36 @@ struct ServerState {
 	uint32_t display_w;
 	uint32_t display_h;
 	uint32_t display_bpp;
-	void* framebuffer;
+	uint32_t pitch;    /* bytes per row of the scanout buffers and shadow */
+	void* framebuffer; /* first scanout buffer, possibly write-combined */
+	void* shadow;      /* cached copy compositing targets, or NULL */
 
-	struct InputState input;
+	/* Swapchain, indexes into scanout or -1 */
+	struct ScanoutBuffer scanout[MAX_SCANOUT_BUFFERS];
+	int scanout_count;
+	int front;   /* being scanned out */
+	int pending; /* flip requested, not completed yet */
+	int queued;  /* composed ahead while a flip is pending */
+	uint64_t frame;
+	uint32_t refresh;
+
+	const struct OutputBackend* backend;
+
+	/* Screen area that needs repainting, guarded by lock */
+	struct Region damage;
+	pthread_mutex_t lock;
+
+	/* Frame scheduling, guarded by lock too */
+	pthread_cond_t frame_cond;
+	int frame_requested;
+	int frames_held; /* transactions being applied, see hold_frames() */
+	struct timespec next_frame; /* CLOCK_MONOTONIC */
+
+	/* Presentation, guarded by lock too */
+	uint64_t composed;  /* compositions so far */
+	uint64_t presented; /* last composition on screen */
+	uint64_t shown;     /* frames flipped on screen so far */
+	struct timespec presented_at;
 
 	struct Client* clients;
 	int client_count;
@@ -69,12 +180,20 @@ typedef enum {
 	IMAGE_SCALED
 } ImageMode;
 
-// Background configuration for now
+// Server configuration
 struct config {
 	BackgroundType type;
 	uint32_t color; // RGBA format
 	ImageMode mode;
 	char path[MAX_PATH_LEN];
+
+	int shadow;  // compose into a cached shadow framebuffer
+	int buffers; // scanout buffers, 1 to MAX_SCANOUT_BUFFERS
+	char backend[16]; // output backend name
+	uint32_t width;   // mode for outputs that have none, headless
+	uint32_t height;
+	uint32_t refresh;
+	int workers; // compositor threads, 0 for one per CPU
 };
 
 // Parse config file
@@ -90,24 +209,198 @@ int apply_background(struct config* config, uint32_t* buffer, uint32_t width, ui
 #define CURSOR_HOTSPOT_X 0
 #define CURSOR_HOTSPOT_Y 0
 
+/* Render the cursor image, ARGB8888 */
+void draw_cursor(uint8_t* buf, uint32_t stride, uint32_t w, uint32_t h);
+
+/* ----------------------------
+ * Output backends
+ * ---------------------------- */
+
+struct OutputBackend {
+	const char* name;
+
+	/* Set the display mode and create srv->scanout_count buffers */
+	int (*init)(struct ServerState* srv, struct config* config);
+	void (*release)(struct ServerState* srv);
+
+	/* Queue a scanout buffer. Returns 0 when completion will be
+	 * reported with display_flip_done(), nonzero when the buffer was
+	 * shown right away. */
+	int (*flip)(struct ServerState* srv, int buffer);
+
+	void (*move_cursor)(struct ServerState* srv, int x, int y);
+
+	/* fd to poll for completions, or -1, and what to do when ready */
+	int (*event_fd)(struct ServerState* srv);
+	void (*dispatch)(struct ServerState* srv);
+};
+
+extern const struct OutputBackend drm_backend;      /* drm.c */
+extern const struct OutputBackend headless_backend; /* headless.c */
+
 /* ----------------------------
  * Server Functions
  * ---------------------------- */
 
+/**
+ * Region algebra
+ * from region.c, all return 0 on success and -1 on allocation failure
+ */
+void region_init(struct Region* r);
+void region_fini(struct Region* r);
+void region_clear(struct Region* r);
+int region_empty(const struct Region* r);
+int region_copy(struct Region* dst, const struct Region* src);
+struct Rect region_extents(const struct Region* r);
+struct Rect rect_intersect(struct Rect a, struct Rect b);
+
+int region_union_rect(struct Region* r, struct Rect s);
+int region_union(struct Region* dst, const struct Region* src);
+int region_intersect_rect(struct Region* r, struct Rect s);
+int region_intersect(struct Region* dst, const struct Region* src);
+int region_subtract_rect(struct Region* r, struct Rect s);
+int region_subtract(struct Region* dst, const struct Region* src);
+
+/**
+ * Hit testing
+ * from grid.c, grid_update() must be called whenever a window moves
+ * or changes size. Event loop thread only.
+ */
+int init_grid(uint32_t width, uint32_t height);
+
+void grid_update(struct Client* c);
+
+void grid_remove(struct Client* c);
+
+/* Topmost client at x, y, NULL for the background */
+struct Client* pick_client(int x, int y);
+
+/**
+ * Pixel kernels
+ * from blit.c, strides are in bytes. The _nt variants bypass the
+ * cache, use them for destinations that are never read back.
+ */
+void init_blit(void);
+
+void blit_copy_row(uint32_t* dst, const uint32_t* src, size_t n);
+
+void blit_copy_rect(void* dst, size_t dst_stride, const void* src, size_t src_stride, uint32_t w, uint32_t h);
+
+void blit_copy_rect_nt(void* dst, size_t dst_stride, const void* src, size_t src_stride, uint32_t w, uint32_t h);
+
+void blit_fill_rect(void* dst, size_t dst_stride, uint32_t color, uint32_t w, uint32_t h);
+
+void blit_fill_rect_nt(void* dst, size_t dst_stride, uint32_t color, uint32_t w, uint32_t h);
+
+/* Premultiplied src-over, dst is read back so prefer cached memory */
+void blit_blend_rect(void* dst, size_t dst_stride, const void* src, size_t src_stride, uint32_t w, uint32_t h);
+
+/**
+ * Worker pool
+ * from workers.c, run_parallel() calls fn(arg, job) for every job in
+ * 0..jobs-1 on the pool and the calling thread, returning when all
+ * are done. Jobs must not depend on each other.
+ */
+int init_workers(int count);
+
+void release_workers(void);
+
+void run_parallel(void (*fn)(void* arg, int job), void* arg, int jobs);
+
+/**
+ * Client buffers
+ * from buffer.c, allocate_buffers() replaces the buffers of c with
+ * count new ones with the BGCE_BUFFER_* flags, returning the fd to pass
+ * to the client or -1. Sizes of 0 or over BGCE_MAX_BUFFER_SIZE are
+ * refused and leave the old buffers and flags alone.
+ */
+int allocate_buffers(struct Client* c, uint32_t width, uint32_t height, uint32_t count, uint32_t flags);
+
+/* The client finished drawing into buffer index, show it */
+void submit_buffer(struct Client* c, uint32_t index);
+
 /**
  * Display
  */
-int init_display();
+int init_display(struct config* config);
 
 void release_display(void);
 
-void set_drm_cursor(struct ServerState* srv, int x, int y);
+/**
+ * Page flips complete asynchronously: poll display_event_fd() for
+ * reading, when ready call display_dispatch(). Returns -1 when there
+ * is nothing to wait for.
+ */
+int display_event_fd(void);
+
+void display_dispatch(struct ServerState* srv);
+
+/* Called by backends once the pending flip is on screen, when is
+ * CLOCK_MONOTONIC or NULL for now */
+void display_flip_done(struct ServerState* srv, const struct timespec* when);
+
+void move_cursor(struct ServerState* srv, int x, int y);
+
+void draw(struct ServerState* srv, struct Client* cli);
+
+/* Same as draw(), for the rects of the client buffer that changed */
+void draw_rects(struct ServerState* srv, struct Client* cli, const struct BGCERect* rects, size_t n);
+
+/**
+ * Recompute the visible region of every client, must be called
+ * whenever a window is moved, resized, restacked or removed.
+ */
+void update_visibility(struct ServerState* srv);
+
+/**
+ * Damage tracking: mark screen areas as stale, then call
+ * schedule_frame() to have them repainted. composite_damage() paints
+ * them all at once, only the compositor thread calls it.
+ */
+void damage_rect(struct ServerState* srv, struct Rect r);
+
+void damage_client(struct ServerState* srv, const struct Client* c);
+
+/* Move a client, damaging where it was and where it is now */
+void move_client(struct ServerState* srv, struct Client* c, int32_t x, int32_t y);
+
+/**
+ * Give a client a new buffer with its flags, returning the old one, which
+ * the compositor no longer uses once this returns. Damages both areas.
+ */
+void* swap_client_buffer(struct ServerState* srv, struct Client* c, void* buffer,
+                         uint32_t width, uint32_t height, uint32_t stride, uint32_t flags);
+
+/* Show another buffer of the same size, returning the old one like above */
+void* present_client_buffer(struct ServerState* srv, struct Client* c, void* buffer);
+
+void composite_damage(struct ServerState* srv);
+
+/**
+ * Frame scheduler
+ * from scheduler.c, composites the accumulated damage on its own
+ * thread at most once per refresh.
+ */
+int start_compositor(struct ServerState* srv);
+
+void stop_compositor(struct ServerState* srv);
 
-void draw(struct ServerState* srv, struct Client cli);
+/* Ask for a composite at the next frame deadline, never blocks on it */
+void schedule_frame(struct ServerState* srv);
 
-void redraw_region(struct ServerState* srv, struct Client c, int dx, int dy);
+/**
+ * Keep the compositor from painting until release_frames(), so a
+ * client transaction shows all at once.
+ */
+void hold_frames(struct ServerState* srv);
 
-void redraw_from_resize(struct ServerState* srv, struct Client c, int dx, int dy);
+void release_frames(struct ServerState* srv);
+
+/**
+ * A client's callback is due, have the event loop send its
+ * MSG_FRAME_DONE. Any thread, lock held.
+ */
+void wake_frame_callbacks(struct ServerState* srv);
 
 /**
  * Capture the current framebuffer and save it as a screenshot.
@@ -117,17 +410,90 @@ int take_screenshot(const char* filename);
 
 /**
  * Input device related functions
- * from input.c
+ * from input.c, devices are added to the event loop
  */
 int init_input(void);
 
-void* input_loop(void* arg);
+/* Copy up to max of the devices plugged in to out, returns how many;
+ * the rest are left out and logged */
+size_t list_input_devices(struct InputDevice* out, size_t max);
+
+/* Called when c disconnects, so input no longer refers to it */
+void forget_input_client(struct Client* c);
 
 /*
- * Client related stuff
- * from loop.c mainly
+ * Event loop and clients
+ * from loop.c, everything but compositing runs on the loop thread
+ */
+int init_loop(void);
+
+int watch_fd(struct Watch* w, uint32_t events);
+
+void unwatch_fd(struct Watch* w);
+
+/* Change the events w is waited for */
+int rewatch_fd(struct Watch* w, uint32_t events);
+
+/* Accept clients connecting to the listening socket */
+int watch_clients(int listen_fd);
+
+void run_loop(void);
+
+/* Act on one request, from the socket or the command ring */
+void handle_message(struct Client* client, struct BGCEMessage* msg);
+
+/**
+ * Command rings
+ * from ring.c, the loop parks the rings before waiting, so clients
+ * ring the doorbell, and unparks them once it is awake.
  */
-void* client_thread(void* arg);
+int setup_ring(struct Client* c, uint32_t serial);
+
+void release_ring(struct Client* c);
+
+/* Returns 1 when it stopped at a command waiting for the socket */
+int drain_ring(struct Client* c);
+
+void park_rings(void);
+
+void unpark_rings(void);
+
+/**
+ * Outbound queues
+ * from queue.c, messages to clients never block the loop: what the
+ * socket has no room for waits until it is writable. Replies carry the
+ * serial of their request, events 0. fds are copied,
+ * the caller still closes its own. Input events may be merged or
+ * dropped for a client that does not read, returning -1 when dropped.
+ */
+int client_send(struct Client* c, uint32_t type, uint32_t serial, const void* payload, size_t length,
+                const int* fds, int nfds);
+
+int client_send_msg(struct Client* c, struct BGCEMessage* msg);
+
+/* Send what is queued, when the socket is writable */
+void flush_client(struct Client* c);
+
+void release_queue(struct Client* c);
+
+/**
+ * Latency histograms
+ * from latency.c, times are CLOCK_MONOTONIC ns, 0 for unknown. The
+ * _locked functions need the server lock: damage caused by an input
+ * goes into the next composition, which is timed until it is shown.
+ */
+uint64_t monotonic_ns(void);
+
+/* Record, for a BGCE_LATENCY_* stage, the time since input_ns */
+void record_latency(int stage, uint64_t input_ns);
+
+void latency_damage_locked(uint64_t input_ns);
+
+void latency_composed_locked(uint64_t composed);
+
+void latency_shown_locked(uint64_t composed, const struct timespec* when);
+
+void latency_report(struct LatencyReport* report);
 
 int setup_vt_handling(void);
 
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Run the server headless with 2 and 3 scanout buffers and animate the
+# test client on it as fast as it can draw: every frame must be shown,
+# and the server must stay mostly idle doing so, one 800x600 window at
+# 60 Hz is little work. This covers flips, pacing and the bookkeeping of
+# what each buffer is missing without a display; three buffers also
+# prepare frames while a flip is pending. High server CPU only warns,
+# set MAX_CPU (percent of one core, about 5 is normal) to fail on it.
+
+FRAMES=120
+
+home=$(mktemp -d)
+mkdir -p "$home/.config"
+export LD_LIBRARY_PATH=.${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+hz=$(getconf CLK_TCK)
+status=0
+
+for buffers in 2 3; do
+	printf '[display]\nbackend = headless\nbuffers = %s\n' "$buffers" > "$home/.config/bgce.conf"
+
+	HOME=$home ./bgce > "$home/server.log" 2>&1 &
+	pid=$!
+	sleep 1
+	echo "[MAKE] Server running with $buffers buffers"
+
+	start=$(date +%s%N)
+	HOME=$home timeout 30 ./client $FRAMES > "$home/client.log" 2>&1
+	rc=$?
+	elapsed=$((($(date +%s%N) - start) / 1000000))
+
+	read -r utime stime < <(cut -d' ' -f14,15 /proc/$pid/stat)
+	kill $pid
+	wait $pid 2>/dev/null
+
+	shown=$(grep -c "shown at" "$home/client.log")
+	cpu=$(((utime + stime) * 1000 * 100 / hz / (elapsed + 1000)))
+	echo "[MAKE] client rc=$rc, $shown of $FRAMES frames shown in ${elapsed}ms, server cpu ${cpu}%"
+
+	failed=0
+	if [ $rc -ne 0 ] || [ "$shown" -ne $FRAMES ]; then
+		failed=1
+	elif [ $cpu -gt "${MAX_CPU:-15}" ]; then
+		echo "[MAKE] WARNING: server cpu over ${MAX_CPU:-15}%"
+		[ -n "$MAX_CPU" ] && failed=1
+	fi
+	if [ $failed -ne 0 ]; then
+		echo "[MAKE] FAILED with $buffers buffers"
+		tail -n 20 "$home/server.log"
+		status=1
+	fi
+done
+
+rm -rf "$home"
+echo "[MAKE] Test finished."
+exit $status
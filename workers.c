@@ -0,0 +1,157 @@
+#include "server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * A fixed pool of threads that runs batches of independent jobs, the
+ * compositor uses it to paint screen tiles in parallel. The thread
+ * that submits a batch works on it too.
+ *
+ * Each worker starts with an equal slice of the job indexes and takes
+ * them from the front of its slice. Once its slice is empty it steals
+ * from the others, so a few expensive tiles, like those under a large
+ * translucent window, do not leave the rest of the pool idle.
+ */
+
+#define MAX_WORKERS 16
+
+struct Slice {
+	int next; /* advanced atomically, may overshoot end */
+	int end;
+} __attribute__((aligned(64)));
+
+static struct {
+	pthread_t threads[MAX_WORKERS];
+	int count; /* including the submitting thread */
+
+	pthread_mutex_t batch_lock; /* one batch at a time */
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	uint64_t generation;
+	int running; /* workers still busy with the batch */
+	int quit;
+
+	void (*fn)(void* arg, int job);
+	void* arg;
+	struct Slice slices[MAX_WORKERS];
+} pool = {
+        .count = 1,
+        .batch_lock = PTHREAD_MUTEX_INITIALIZER,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .start = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+};
+
+static int take_job(struct Slice* s) {
+	if (__atomic_load_n(&s->next, __ATOMIC_RELAXED) >= s->end)
+		return -1;
+	int job = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED);
+	return job < s->end ? job : -1;
+}
+
+static void work(int self) {
+	for (int i = 0; i < pool.count; i++) {
+		struct Slice* s = &pool.slices[(self + i) % pool.count];
+		int job;
+		while ((job = take_job(s)) >= 0)
+			pool.fn(pool.arg, job);
+	}
+}
+
+static void* worker_main(void* arg) {
+	int self = (int)(intptr_t)arg;
+	uint64_t seen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (!pool.quit && pool.generation == seen)
+			pthread_cond_wait(&pool.start, &pool.lock);
+		if (pool.quit)
+			break;
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+
+		work(self);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.running == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+int init_workers(int count) {
+	if (count <= 0)
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (count < 1)
+		count = 1;
+	if (count > MAX_WORKERS)
+		count = MAX_WORKERS;
+
+	for (int i = 1; i < count; i++) {
+		int rc = pthread_create(&pool.threads[i], NULL, worker_main, (void*)(intptr_t)i);
+		if (rc != 0) {
+			errno = rc;
+			perror("[BGCE] Failed to start compositor worker");
+			break;
+		}
+		pool.count = i + 1;
+	}
+
+	printf("[BGCE] Compositing with %d threads\n", pool.count);
+	return pool.count;
+}
+
+void release_workers(void) {
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (int i = 1; i < pool.count; i++)
+		pthread_join(pool.threads[i], NULL);
+	pool.count = 1;
+	pool.quit = 0;
+}
+
+void run_parallel(void (*fn)(void* arg, int job), void* arg, int jobs) {
+	if (jobs <= 0)
+		return;
+	if (jobs == 1 || pool.count == 1) {
+		for (int i = 0; i < jobs; i++)
+			fn(arg, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.batch_lock);
+
+	int n = pool.count;
+	for (int i = 0; i < n; i++) {
+		pool.slices[i].next = jobs * i / n;
+		pool.slices[i].end = jobs * (i + 1) / n;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.running = n - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	work(0);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.running > 0)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_mutex_unlock(&pool.batch_lock);
+}